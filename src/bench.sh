@@ -0,0 +1,20 @@
+#!/bin/bash
+# Replays keystroke traces against a generated file with kilo --headless and prints what each scenario cost.
+# Usage: ./bench.sh [LINES]
+LINES=${1:-200000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$LINES" 'BEGIN { for (i = 1; i <= n; i++) printf "line %d: the quick brown fox jumps over the lazy dog\t%d\n", i, i * 7 }' > "$DIR/data.txt"
+
+: > "$DIR/open"                                                                   # open the file and draw it
+awk -v n="$LINES" 'BEGIN { printf "\006line %d:\r", n / 2;                        # type 10k characters mid-file
+  for (i = 1; i <= 10000; i++) printf (i % 64 ? "%c" : "\r"), 97 + i % 26 }' > "$DIR/type"
+awk -v n="$LINES" 'BEGIN { for (i = 0; i <= n / 22; i++) printf "\033[6~" }' > "$DIR/scroll" # page through the whole file
+awk 'BEGIN { printf "\006fox"; for (i = 0; i < 2000; i++) printf "\033[B"; printf "\r" }' > "$DIR/search" # step through matches
+awk 'BEGIN { for (i = 0; i < 20; i++) printf "x\023" }' > "$DIR/save"            # edit and save, 20 times
+
+for s in open type scroll search save; do
+  cp "$DIR/data.txt" "$DIR/work.txt"
+  ./kilo --headless "$DIR/$s" "$DIR/work.txt" || exit 1
+done
@@ -9,15 +9,29 @@
 #include <ctype.h>            //for iscntrl()
 #include <errno.h>
 #include <fcntl.h>           //for open()
+#include <limits.h>          //for INT_MAX
+#include <poll.h>            //for poll()
+#include <pthread.h>         //for the search threads
+#include <signal.h>          //for sigaction()
 #include <stdio.h>
 #include <stdarg.h>         //for va_list, va_start, va_end
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>     //for flock()
 #include <sys/ioctl.h>
+#include <sys/mman.h>     //for mmap()
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>      //for writev()
 #include <termios.h>
 #include <time.h> //for time_t
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h> //for follow mode
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  //for the SSE2/AVX2 line scanner
+#endif
 
 /*-------------------------------------------------------------------------------------------------------------------------------*/
 /******************************************************** Defines ****************************************************************/
@@ -27,8 +41,44 @@
 #define KILO_TAB_STOP 8        //tab stop is every 8 columns
 #define CTRL_KEY(k) ((k) & 0x1f) //bitwise AND operation with 00011111, which strips the 5th and 6th bits of any character and turns it into a control character.
 #define KILO_QUIT_TIMES 3       //number of times to press Ctrl-Q before quitting.
+#define KILO_ROPE_LEAF_MAX 128  //maximum number of rows held by a single leaf of the row rope.
+#define KILO_CHECKPOINT_LINES 1024 //lines between two entries of the index of byte offsets.
+#define KILO_GAP_MIN 16         //smallest gap a row buffer is grown by when text is inserted into it.
+#define KILO_SLAB_MIN 16        //smallest size class of the row buffer slabs.
+#define KILO_SLAB_CLASSES 9     //size classes of the slabs, doubling from KILO_SLAB_MIN; larger buffers come from malloc().
+#define KILO_SLAB_PAGE 65536    //size of the pages the slabs carve buffers out of.
+#define KILO_ARENA_BLOCK (1024 * 1024) //size of the arena blocks bulk inserted text is copied into.
+#define KILO_SAVE_IOV 1024      //number of iovecs handed to one writev() call when saving.
+#define KILO_SAVE_STAGE 65536   //size of the buffer short pieces of text are gathered in when saving.
+#define KILO_SAVE_COPY_MAX 256  //pieces shorter than this are copied into the stage, longer ones are written in place.
+#define KILO_SEARCH_THREADS 8   //most threads a search scan runs on.
+#define KILO_SEARCH_TASK_ROWS 65536 //rows a search thread takes at a time.
+#define KILO_SEARCH_INDEX_MAX 4194304 //most matches kept in the search index, further matches are only counted.
+#define KILO_REGEX_PROG_MAX 65536 //most instructions a compiled regular expression may have.
+#define KILO_REGEX_REPEAT_MAX 1000 //largest count allowed in a {m,n} repeat.
+#define KILO_REGEX_DFA_MAX 512  //DFA states kept per regular expression and direction before they are thrown away and rebuilt.
+#define KILO_UNDO_LIMIT (64 * 1024 * 1024) //default size the undo log may grow to, KILO_UNDO_MB in the environment overrides it.
+#define KILO_UNDO_RUN_MAX 1024  //longest run of typing merged into one undo entry.
+#define KILO_JOURNAL_SUFFIX ".kilo-journal" //the journal of FILE is .FILE.kilo-journal, in the same directory.
+#define KILO_JOURNAL_MAGIC "KILOJNL1" //first bytes of a journal file.
+#define KILO_JOURNAL_RING (1024 * 1024) //bytes of records the main thread can queue before the writer thread takes them.
+#define KILO_JOURNAL_SYNC 1000  //milliseconds the journal may go without an fsync() after it was written to.
+#define KILO_FOLLOW_POLL 250    //milliseconds between looks at a followed file when inotify cannot watch it.
+#define KILO_FOLLOW_CHUNK (1024 * 1024) //bytes of a followed file read at once.
+#define KILO_FOLLOW_FRAME (16 * 1024 * 1024) //most new bytes of a followed file turned into rows before a frame, the rest waits for the next one.
+#define KILO_INPUT_BUF 4096     //bytes of terminal input read at once, which is also the most keys one read can hold.
+#define KILO_ESC_TIMEOUT 100    //milliseconds to wait for the rest of an escape sequence before ESC is taken as a key.
+#define KILO_FPS 60             //most frames drawn per second, KILO_FPS in the environment overrides it.
+#define KILO_SYNTAX_LOOKBACK 1000 //rows above the screen lexed to guess the state it starts in, when the rows before them are not highlighted.
+#define KILO_LONG_LINE 65536    //rows at least this long are lexed a chunk at a time and drawn without a render field.
+#define KILO_LONG_CHUNK 4096    //size of the chunks a long row is lexed in; the lexer state is kept where each one starts.
+#define KILO_LEX_AHEAD 32       //characters past a position the lexer may read, to match a keyword or a comment delimiter.
+#define KILO_STAT_SUB_BITS 4    //a stats histogram splits every power of two into 2^4 buckets, so a value is known to within 1/16.
+#define KILO_STAT_BUCKETS ((64 - KILO_STAT_SUB_BITS + 1) << KILO_STAT_SUB_BITS) //buckets that cover every 64 bit value.
 
-#define ABUF_INIT {NULL, 0}    //initialize the abuf struct
+#define HL_HIGHLIGHT_NUMBERS (1<<0) //highlight numbers
+
+#define ABUF_INIT {NULL, 0, 0}    //initialize the abuf struct
 
 enum editorKey 
 {
@@ -41,26 +91,397 @@ enum editorKey
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_BEGIN, //ESC [ 200 ~, which starts a bracketed paste; only the input decoder sees it
+  PASTE, //a whole bracketed paste was read, its text is in E.input.paste from pastefrom to pasteto
+  FOLLOW //the followed file changed; only wakes the main loop, which reads it before the next frame
+};
+
+enum undoOp
+{
+  UNDO_INSERT, //text was inserted
+  UNDO_DELETE  //text was deleted
+};
+
+enum undoFlags
+{
+  UNDO_NEWROW = 1 //the insert was past the last row, so a row was appended for it
+};
+
+enum rowFlags
+{
+  ROW_MAPPED = 1 //chars points into the file mapping or an arena block and is not owned by the row
+};
+
+enum editorHighlight            //highlight class of a character
+{
+  HL_NORMAL = 0,
+  HL_COMMENT, //a single-line comment
+  HL_MLCOMMENT, //a multi-line comment
+  HL_KEYWORD1, //a keyword
+  HL_KEYWORD2, //a keyword of the second kind, such as a type name
+  HL_STRING,
+  HL_NUMBER,
+  HL_MATCH = 0x40, //added to the class of a screen column covered by a search match
+  HL_CURRENT = 0x80 //added to the class of a screen column covered by the current search match
+};
+
+enum hlState                    //state of the lexer at the end of a row, which is where the next row starts
+{
+  HLS_NORMAL = 0,
+  HLS_COMMENT, //inside a multi-line comment
+  HLS_LINE_COMMENT //inside a single-line comment, which never reaches the next row
 };
 
 /*-------------------------------------------------------------------------------------------------------------------------------*/
 /******************************************************** Data *******************************************************************/
 /*-------------------------------------------------------------------------------------------------------------------------------*/
+typedef struct rowWide          //an entry of a row's column index: a tab, or a character that is not ASCII
+{
+  int at; //index of the character, or its distance from the end of the row for the ones after the text gap
+  int rx; //screen column the character starts at
+} rowWide;
+
+typedef struct hlLexer          //everything the lexer knows at a position of a row, so that it can carry on from there
+{
+  unsigned char comment; //an hlState
+  unsigned char string; //the quote that opened the string being read, 0 outside of strings
+  unsigned char sep; //the previous character was a separator, which the start of the row counts as
+  unsigned char number; //the previous character was part of a number
+} hlLexer;
+
+typedef struct rowChunk         //where a chunk of a long row starts, and the state of the lexer there
+{
+  int at; //index of the first character of the chunk
+  hlLexer lex; //the state the chunk is lexed from
+  unsigned char stale; //the text before at changed since lex was worked out
+} rowChunk;
+
+typedef struct rowLong          //the highlights of a row of at least KILO_LONG_LINE characters, see editorSyntaxWindow()
+{
+  rowChunk *chunks; //the chunks in order, the first starts at 0 and the last one, which is empty, at the end of the row
+  int n, cap; //number of chunks, room in chunks
+  int from, len; //hl holds the classes of the characters [from, from + len)
+  unsigned version; //version of the text those classes were lexed from
+} rowLong;
+
 typedef struct erow             //holds a line of text as a pointer to a character array, a length, and a render field
 {
   int size; //size of the chars field
   int rsize; //size of the render field
-  char *chars; //a pointer to a character array that holds the actual text of the row
-  char *render; //a pointer to a character array that holds the rendered version of the row
+  char *chars; //a gap buffer that holds the actual text of the row: chars[0..gap) and chars[gap+gaplen..size+gaplen)
+  int gap; //start of the gap, the text after it continues at chars[gap + gaplen]
+  int gaplen; //length of the gap
+  char *render; //the rendered version of the row, built on demand and only for rows that contain tabs
+  int rcap; //allocated size of render
+  int tabs; //number of tabs in the row; without tabs the render field is the text itself
+  int utf8; //number of UTF-8 lead bytes in the row, that is characters that are not ASCII; -1 until they are counted
+  rowWide *wide; //column index of the tabs and the characters that are not ASCII, NULL until it is first needed, see editorWideBuild()
+  int widecap; //room in wide
+  int widegap; //number of entries before the text gap
+  int widerx; //number of entries at the start of the row whose rx is known
+  unsigned version; //bumped on every change to the text
+  unsigned rversion; //version of the text that render was built from
+  int flags; //ROW_* flags
+  unsigned char *hl; //the highlight class of each character, NULL until the row is first highlighted
+  int hlcap; //allocated size of hl
+  unsigned hlversion; //version of the text that hl was built from
+  unsigned char hlin, hlout; //hlState the row was highlighted from, and the one it ends in
+  rowLong *longhl; //for a long row, the chunks it is lexed in; hl then only holds the classes around the screen
 } erow;
 
+typedef struct rnode            //a leaf of the row rope: a block of consecutive rows, kept in a treap ordered by row index
+{
+  struct rnode *left; //leaves holding the rows before this one
+  struct rnode *right; //leaves holding the rows after this one
+  unsigned prio; //random heap priority, keeps the treap balanced
+  int count; //number of rows in this subtree
+  int n; //number of rows in this leaf
+  erow *rows; //the rows of this leaf, room for KILO_ROPE_LEAF_MAX of them, NULL until the leaf is first used
+  int line0; //index of the leaf's first line in the file line index while its rows are not built yet, -1 otherwise
+  int touched; //editorRow() handed out one of its rows, which may have an open gap since, see searchCollect()
+} rnode;
+
+struct lineCheckpoints          //where every KILO_CHECKPOINT_LINES-th line starts, see the Row Storage section
+{
+  long long *off; //off[k] is the byte offset of line k * KILO_CHECKPOINT_LINES in the file as it would be saved
+  int n; //entries of off that are up to date
+  int cap; //room in off
+};
+
+typedef struct lineWalk         //a walk over the rows that adds up the bytes they take, see checkpointWalk()
+{
+  int at; //the next row
+  long long off; //the byte offset of row at
+  int stop; //the row to stop at
+  long long target; //or stop at the row that holds this byte offset, -1 for none
+} lineWalk;
+
+typedef struct searchMatch      //the position of a match in the search index
+{
+  int row, col;
+} searchMatch;
+
+typedef struct searchSpan       //a leaf of the rope as seen by the search threads
+{
+  int row0, n; //the rows of the leaf
+  erow *rows; //its rows, with their gaps closed before the scan starts, or NULL when they are read from the mapping
+  int line0; //first line of the leaf in the mapping when rows is NULL
+} searchSpan;
+
+typedef struct searchTask       //consecutive leaves searched by one thread in one go
+{
+  int span0, nspans; //the leaves
+  searchMatch *m; //the matches found, in file order
+  int mn; //number of matches in m
+  int mcap; //room in m
+  int full; //the index ran out of room, so some matches of this task were counted but not kept
+} searchTask;
+
+struct editorSearch             //state of the incremental search
+{
+  char *query; //the text being searched for, NULL when no search is active
+  int len; //length of query
+  int regex; //the query is a regular expression
+  struct regex *re; //the compiled query in regex mode, NULL if it is not valid
+  struct regexCache *rc; //the DFAs of re used by the main thread
+  const char *error; //why the query is not a valid regular expression
+  char prompt[80]; //the prompt, which depends on the mode
+  const char *lit; //the literal searched for: the query, or the prefix of the regular expression
+  int litlen; //length of lit, 0 when a regular expression has no prefix
+  int skip[256]; //Boyer-Moore-Horspool shift of lit for every byte value
+  int row, col; //the current match, row is -1 when there is none
+  int cx, cy, rowoff, coloff; //where the view was when the search started, restored when it is cancelled
+  pthread_t threads[KILO_SEARCH_THREADS]; //the threads of the scan that counts and indexes every match
+  int nthreads; //number of threads started, 0 when no scan is running
+  searchSpan *spans; //the leaves of the rope, in order
+  int nspans, spanscap; //number of leaves, room in spans
+  searchTask *tasks; //the leaves grouped into tasks, in order
+  int ntasks; //number of tasks, 0 when there is no scan
+  int first; //the task that holds the cursor, where the scan starts
+  int next; //number of tasks handed out, counted from first
+  int finished; //number of tasks searched
+  int cancel; //set to make the threads stop
+  long count; //matches found so far
+  int stored; //matches offered to the index so far
+  long shown; //the count the message bar last showed
+  int shownfinished; //the finished count the message bar last showed
+};
+
+struct editorSyntax             //highlighting rules for a type of file
+{
+  char *filetype; //name shown in the status bar
+  char **filematch; //extensions (starting with '.') or parts of the file name that select the rules
+  char **keywords; //keywords, the ones ending in '|' are of the second kind
+  char *singleline_comment_start; //NULL when the language has no comments of that kind
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  char *quotes; //the characters strings are quoted with, NULL for none
+  int flags; //HL_HIGHLIGHT_* flags
+};
+
+struct saveBatch                //text queued for one writev() call while saving
+{
+  int fd; //the file being written
+  struct iovec *iov; //pieces to write, pointing into rows, the file mapping or stage
+  int iovcnt; //number of pieces queued
+  char *stage; //copies of short pieces, so that a file of short lines does not become one iovec per line
+  int stagelen; //bytes used in stage
+  size_t total; //bytes written so far
+};
+
+typedef struct lineScan         //line boundaries found by editorScanLines
+{
+  size_t *end; //offset of the newline that ends each line, or the buffer length for an unterminated last line
+  unsigned *tabs; //number of tabs in each line
+  int withtabs; //fill in tabs, otherwise it stays NULL
+  size_t n; //number of lines found
+  size_t cap; //room in end (and tabs)
+  size_t crlf; //number of lines that ended with \r\n
+} lineScan;
+
+typedef size_t (*scanKernel)(const char *buf, size_t pos, size_t len, unsigned *tabs, lineScan *out); //one of the scanner kernels
+
+typedef struct arenaBlock       //a block of text that rows are views into, see the Row Memory section
+{
+  char *base; //the text
+  size_t len; //size of the block
+  size_t used; //bytes handed out from the start of the block
+  long rows; //rows that are views into the block, which is freed when there are none left
+} arenaBlock;
+
+struct rowMemory                //where the buffers of the rows come from, see the Row Memory section
+{
+  char *slabfree[KILO_SLAB_CLASSES]; //buffers of each size class that were given back, linked through their first bytes
+  char *slabnext[KILO_SLAB_CLASSES]; //the part of the newest page of each class that was never handed out
+  char *slabend[KILO_SLAB_CLASSES];
+  size_t slabpages; //bytes of slab pages
+  size_t slabused; //bytes of slab buffers handed out
+  size_t heap; //bytes of buffers too large for the slabs
+  arenaBlock *blocks; //the arena blocks, ordered by address
+  int nblocks, blockscap; //number of blocks, room in blocks
+  char *fill; //base of the block bulk text is being copied into, NULL for none
+  size_t arena; //bytes in arena blocks
+};
+
 struct abuf  //append buffer struct for 'Append Buffer' Section
 {
   char *b;
   int len;
+  int cap; //allocated size of b
+};
+
+struct editorInput              //terminal input that was read but not processed yet
+{
+  char buf[KILO_INPUT_BUF]; //bytes read but not decoded, the start of an escape sequence that is not complete yet
+  int len; //bytes in buf
+  int keys[KILO_INPUT_BUF]; //keys decoded from the last read
+  int head; //the next key to hand out
+  int nkeys; //number of keys in keys
+  int wakefd[2]; //a pipe that wakes the input loop up, written to by the SIGWINCH handler and the search threads
+  int pasting; //inside a bracketed paste: bytes are collected in paste instead of being decoded
+  struct abuf paste; //the texts of the pastes decoded from the last read, one after the other, then of the one being read
+  int pasteend[KILO_INPUT_BUF]; //for every PASTE key in keys, in order, where its text ends in paste
+  int npastes; //number of pastes in pasteend
+  int pastehead; //the next paste to hand out
+  int pastefrom, pasteto; //the text in paste of the PASTE key handed out last
+};
+
+
+typedef struct undoEntry        //header of an entry of the undo log, followed by its text and then its size again
+{
+  int op; //an undoOp
+  int flags; //undoFlags
+  int row, col; //where the text was inserted or deleted
+  int len; //length of the text, which may hold '\n' between rows
+  int cx, cy; //the cursor before the edit, where undo puts it back
+  int id; //serial number, which also names the state of the file right after the edit
+  int size; //bytes taken by the entry: header, text, padding and trailing size
+} undoEntry;
+
+struct undoLog                  //the edits that undo and redo walk through
+{
+  char *buf; //the entries, oldest first
+  int len; //bytes of buf in use
+  int cap; //bytes allocated
+  int pos; //end of the entries that are applied, the ones after it can be redone
+  int limit; //size the log may grow to before its oldest entries are dropped
+  int nextid; //id of the last entry made
+  int baseid; //names the state before the oldest entry in the log
+  int savedid; //names the state last written to disk
+  int replaying; //set while undo or redo edit the file, so that nothing is logged
+};
+
+typedef struct journalHeader    //start of a journal file: the file its edits apply to
+{
+  char magic[8]; //KILO_JOURNAL_MAGIC
+  long long size; //size of the file when it was opened or last saved, -1 if it was not there
+  long long mtime, mtimensec; //and its modification time
+} journalHeader;
+
+typedef struct journalEntry     //header of a record of the journal, followed by its text
+{
+  unsigned size; //bytes in the record, header included
+  unsigned sum; //checksum of the record with sum taken as 0, so that a record cut short by a crash is noticed
+  int op; //an undoOp
+  int flags; //undoFlags; on a delete, UNDO_NEWROW removes the row the text was on as well
+  int row, col; //where the text was inserted or deleted
+  int len; //length of the text, which may hold '\n' between rows
+} journalEntry;
+
+struct editorJournal            //the crash recovery journal, see the Journal section
+{
+  int on; //edits are being journaled
+  int fd; //the journal file, written by the writer thread
+  char *path; //its name
+  journalHeader base; //the file as it was opened or last saved
+  int based; //base was queued since the file was opened or saved, so records can follow it
+  char *ring; //KILO_JOURNAL_RING bytes the records are queued in
+  unsigned long long head; //bytes ever put into ring, moved by the main thread only
+  unsigned long long tail; //bytes ever taken out of ring, moved by the writer thread only
+  unsigned long long queued; //bytes ever queued, counting the ones still in over
+  unsigned long long notified; //head when the writer was last woken
+  unsigned long long cut; //1 + the number of bytes queued when the file was last saved, 0 before that
+  struct abuf over; //records that found the ring full, they go in as soon as there is room
+  int overoff; //bytes at the start of over that are in the ring already
+  int waiting; //records wait in over: the writer wakes the main thread once it made room
+  int notify[2]; //a pipe that wakes the writer thread up
+  int stop; //tells the writer thread to write what is left and finish
+  int failed; //errno of a write the writer thread could not make, for the main thread to report
+  int discard; //remove the journal on exit, the user quit
+  pthread_t thread;
+};
+
+struct editorFollow             //a file that is followed as it grows, see the Follow section
+{
+  int on; //following E.filename
+  int fd; //the file that is read, which keeps being read if it is renamed away until another one takes its name
+  dev_t dev; //the file fd refers to
+  ino_t ino;
+  off_t offset; //bytes of the file read so far
+  int partial; //the last row is a line the file does not have the end of yet
+  int pending; //the file may have changed since it was last read
+  int notifyfd; //inotify descriptor that wakes the input loop when the file changes, -1 to look every KILO_FOLLOW_POLL ms
+  int wd, dirwd; //inotify watches on the file and on its directory
+  struct abuf buf; //the new text is read into it
+};
+
+struct frameState               //what the last frame showed, to tell whether the next one would be any different
+{
+  int cx, cy, rowoff, coloff; //the view, after scrolling
+  int dirty; //the file was shown as modified
+  int msgshown; //the status message was shown, it goes away after 5 seconds
+  int searchrow, searchcol; //the current search match
+  unsigned long changes; //E.changes
+};
+
+enum statHist                   //what the stats keep a histogram of
+{
+  STAT_DECODE = 0, //nanoseconds turning input bytes into keys
+  STAT_EDIT, //nanoseconds handling a key
+  STAT_SCROLL, //nanoseconds in editorScroll()
+  STAT_DRAW, //nanoseconds in editorDrawRows()
+  STAT_WRITE, //nanoseconds writing a frame to the terminal
+  STAT_BYTES, //bytes written per frame
+  STAT_ALLOCS, //malloc(), calloc() and realloc() calls per frame, counting the keys handled before it
+  STAT_HISTS
+};
+
+struct statHistogram            //an HDR histogram: buckets of a fixed relative width, over every 64 bit value
+{
+  long long count, sum, max; //values recorded, their total, the largest one
+  unsigned counts[KILO_STAT_BUCKETS]; //values recorded in each bucket
+};
+
+struct editorStats              //instrumentation, always on
+{
+  struct statHistogram hist[STAT_HISTS];
+  long long editstart; //when the key being handled was handed out, 0 when there is none
+  unsigned long allocs; //allocation calls the main thread made so far, see xmalloc()
+  unsigned long allocsshown; //allocs when the last frame was drawn
+  long long written; //bytes written to the terminal so far
+  long long frames; //frames written so far
+  int overlay; //the status bar shows the stats (1) or the memory report (2) instead of the file name
+  const char *dump; //file the histograms are written to on exit, from KILO_STATS
+};
+
+struct memUsage                 //what the memory report counts, see memMeasure()
+{
+  size_t text; //bytes of text in the file, without line endings
+  size_t rows; //the rows and the leaves of the rope
+  size_t index; //the line index of the file mapping
+  size_t longhl; //the chunk lists of long rows
+  long leaves, built; //leaves of the rope, and the ones whose rows exist
 };
 
+struct benchStats               //timings taken in headless mode
+{
+  const char *name; //the trace, which names the report
+  double openms; //milliseconds it took to open the file
+  long long keystart; //when the key being handled was handed out, 0 when there is none
+  long long *lat; //nanoseconds each key took, from being handed out until the next key was asked for
+  int n, cap; //keys timed, room in lat
+};
 
 struct editorConfig             //holds all the editor state
 {
@@ -71,12 +492,47 @@ struct editorConfig             //holds all the editor state
   int screenrows; //the number of rows in the screen
   int screencols; //the number of columns in the screen
   int numrows; //the number of rows in the file
-  erow *row; //a pointer to an array of erow structs that holds the rows of the file
+  rnode *rope; //the root of the row rope that holds the rows of the file
+  struct rowMemory mem; //the slabs and arena blocks the text of the rows is kept in
+  struct lineCheckpoints checkpoints; //the byte offsets of a sparse set of lines
   int dirty; //a flag to indicate whether the file has been modified
   char *filename; //the name of the file being edited
+  char *map; //read-only mapping of the opened file, NULL if it was read with stdio
+  size_t maplen; //length of the mapping
+  size_t *lineend; //offset of the newline (or end of file) that ends each line of the mapping
+  size_t maplines; //number of lines in lineend
+  unsigned *linetabs; //number of tabs in each line of the mapping
+  int crlf; //the file used \r\n line endings, and is saved with them
+  int eolmixed; //some lines of the mapping end differently from how the file is saved, so none of it is saved as it is
   char statusmsg[80]; //a status message to display in the status bar
   time_t statusmsg_time; //the time at which the status message was set
   struct termios orig_termios; //the original terminal attributes
+  struct abuf frame; //the output of a frame, kept between frames so its memory is reused
+  struct abuf linebuf; //scratch buffer a screen line is composed in
+  struct abuf hlbuf; //scratch buffer a row is drawn in before highlights are added
+  struct abuf hlcols; //scratch buffer for the highlight class of each byte of a drawn row
+  struct abuf hlsrc; //scratch buffer for the index of the character each byte of a drawn row comes from, as ints
+  struct abuf lexbuf; //scratch buffer the part of a long row being lexed is copied into
+  struct editorSyntax *syntax; //highlighting rules for the file, NULL when it is not highlighted
+  int hlvalid; //the rows before this one have highlights that are up to date and agree with each other
+  struct abuf *screen; //the bytes last sent for each line of the screen, len -1 when unknown
+  int screenlines; //number of lines in screen, the text rows plus the status and message bars
+  int fullredraw; //clear the terminal and repaint every line in the next frame
+  int lastcx, lastcy; //where the cursor was left by the last frame
+  unsigned long changes; //bumped by every change to the text or the status message
+  struct frameState shown; //the state the last frame was drawn from
+  int frameinterval; //milliseconds between frames at the most frames per second
+  int infd, outfd; //where keys are read from and frames are written to: the terminal, or a trace and a capture when headless
+  int headless; //running without a terminal, see editorHeadless()
+  struct benchStats bench; //timings taken in headless mode
+  struct editorStats stats; //latency and allocation counters
+  volatile sig_atomic_t resized; //set by the SIGWINCH handler
+  volatile sig_atomic_t hangup; //set by the SIGHUP and SIGTERM handler
+  struct editorSearch search; //the incremental search
+  struct undoLog undo; //the undo log
+  struct editorJournal journal; //the crash recovery journal
+  struct editorFollow follow; //follow mode
+  struct editorInput input; //keys waiting to be processed
 };
 
 struct editorConfig E;          //A global variable to hold the editor state
@@ -86,8 +542,31 @@ struct editorConfig E;          //A global variable to hold the editor state
 /*-------------------------------------------------------------------------------------------------------------------------------*/
 
 void editorSetStatusMessage(const char *fmt, ...); 
+void benchKeyStart();
+void benchKeyDone();
+long long benchNanos();
 void editorRefreshScreen(); 
-char *editorPrompt(char *prompt);
+void editorCursorFit();
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorRowInit(erow *row, char *chars, int size, int gaplen, int tabs, int flags);
+char *editorRowFlat(erow *row);
+void editorRowCopy(erow *row, int at, int len, char *dst);
+void editorFreeRow(erow *row);
+void undoRecord(int op, int row, int col, const char *s, int len, int flags);
+void journalEdit(int op, int row, int col, const char *s, int len, int flags);
+void journalPump();
+int abReserve(struct abuf *ab, int len);
+void abAppend(struct abuf *ab, const char *s, int len);
+int searchScanProgress();
+void editorScanLines(const char *buf, size_t len, lineScan *out);
+void scanAddLine(lineScan *out, size_t end, unsigned tabs);
+void statRecord(int hist, long long value);
+void statEditStart();
+void statEditDone();
+int statOverlay(char *buf, int size);
+void *xmalloc(size_t size);
+void *xcalloc(size_t n, size_t size);
+void *xrealloc(void *p, size_t size);
 
 /*-------------------------------------------------------------------------------------------------------------------------------*/
 /******************************************************** Terminal ***************************************************************/
@@ -95,8 +574,8 @@ char *editorPrompt(char *prompt);
 
 void die(const char *s) 
 {
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  write(E.outfd, "\x1b[2J", 4);
+  write(E.outfd, "\x1b[H", 3);
 
   perror(s);
   exit(1);
@@ -104,6 +583,7 @@ void die(const char *s)
 
 void disableRawMode() 
 {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8); //bracketed paste off
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -119,70 +599,253 @@ void enableRawMode()
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0; //read() returns what is there at once, editorReadKey() waits in poll()
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  write(STDOUT_FILENO, "\x1b[?2004h", 8); //bracketed paste on: the terminal marks pasted text, so that it arrives as one PASTE key
+}
+
+void editorWake() //wake the input loop up so that it repaints; safe in a signal handler and from other threads
+{
+  int saved = errno;
+  write(E.input.wakefd[1], "", 1); //when the pipe is full a wakeup is already pending
+  errno = saved;
+}
+
+void editorHandleResize(int sig) //SIGWINCH handler, the next frame picks up the new size
+{
+  (void)sig;
+  E.resized = 1;
+  editorWake();
 }
 
-int editorReadKey() {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
+void editorHandleHangup(int sig) //SIGHUP and SIGTERM handler: the input loop leaves through exit(), so the journal is written out
+{
+  (void)sig;
+  E.hangup = 1;
+  editorWake();
+}
+
+int editorDecodeKey(const char *s, int len, int *key) //decode the key at the start of s, returns the bytes it takes, 0 if they are not all there yet
+{
+  if (s[0] != '\x1b')
+  {
+    *key = (unsigned char)s[0]; //bytes of UTF-8 text are keys 128-255
+    return 1;
+  }
+  if (len < 2) return 0;
+
+  *key = '\x1b'; //sequences that are not known keys still count as ESC, like a lone ESC
+  if (s[1] == '[')
+  {
+    int i = 2;
+    while (i < len && s[i] >= 0x30 && s[i] <= 0x3f) i++; //parameter bytes
+    while (i < len && s[i] >= 0x20 && s[i] <= 0x2f) i++; //intermediate bytes
+    if (i == len) return 0;
+    if (s[i] < 0x40 || s[i] > 0x7e) return 1; //not a sequence after all: the ESC stands alone
+    if (s[i] == '~' && i == 5 && memcmp(&s[2], "200", 3) == 0)
+      *key = PASTE_BEGIN;
+    else if (s[i] == '~' && i == 3)
+    {
+      switch (s[2])
+      {
+        case '1': *key = HOME_KEY; break;
+        case '3': *key = DEL_KEY; break;
+        case '4': *key = END_KEY; break;
+        case '5': *key = PAGE_UP; break;
+        case '6': *key = PAGE_DOWN; break;
+        case '7': *key = HOME_KEY; break;
+        case '8': *key = END_KEY; break;
+      }
+    }
+    else if (i == 2)
+    {
+      switch (s[2])
+      {
+        case 'A': *key = ARROW_UP; break;
+        case 'B': *key = ARROW_DOWN; break;
+        case 'C': *key = ARROW_RIGHT; break;
+        case 'D': *key = ARROW_LEFT; break;
+        case 'H': *key = HOME_KEY; break;
+        case 'F': *key = END_KEY; break;
+      }
+    }
+    return i + 1;
+  }
+  if (s[1] == 'O')
+  {
+    if (len < 3) return 0;
+    if (s[2] == 'H') *key = HOME_KEY;
+    if (s[2] == 'F') *key = END_KEY;
+    return 3;
+  }
+  return 1;
+}
+
+void editorDecodeInput(int flush) //turn the bytes read into keys; with flush set, an unfinished sequence is taken as ESC and what follows it
+{
+  struct editorInput *in = &E.input;
+  long long start = benchNanos();
+  int pos = 0;
+  in->head = in->nkeys = 0;
+  int used = in->npastes ? in->pasteend[in->npastes - 1] : 0; //the pastes handed out, only a paste still being read is kept
+  if (used)
+  {
+    memmove(in->paste.b, in->paste.b + used, in->paste.len - used);
+    in->paste.len -= used;
+  }
+  in->npastes = in->pastehead = 0;
+  while (pos < in->len)
+  {
+    if (in->pasting) //everything up to the end marker is text, whatever it holds
+    {
+      char *end = memmem(in->buf + pos, in->len - pos, "\x1b[201~", 6);
+      int stop = end ? end - in->buf : in->len;
+      int keep;
+      for (keep = end ? 0 : 5; keep > 0; keep--) //the read may end with the start of the marker, which waits for the rest
+        if (in->len - pos >= keep && memcmp(in->buf + in->len - keep, "\x1b[201~", keep) == 0) break;
+      stop -= keep;
+      abAppend(&in->paste, in->buf + pos, stop - pos);
+      pos = stop;
+      if (!end) break;
+      pos += 6;
+      in->pasting = 0;
+      in->pasteend[in->npastes++] = in->paste.len; //a read may hold several pastes, each key keeps its own text
+      in->keys[in->nkeys++] = PASTE;
+      continue;
+    }
+
+    int used = editorDecodeKey(in->buf + pos, in->len - pos, &in->keys[in->nkeys]);
+    if (used == 0)
+    {
+      if (!flush) break; //wait for the rest of the sequence
+      in->keys[in->nkeys] = '\x1b';
+      used = 1;
+    }
+    pos += used;
+    if (in->keys[in->nkeys] == PASTE_BEGIN)
+    {
+      in->pasting = 1;
+      continue;
+    }
+    in->nkeys++;
   }
+  memmove(in->buf, in->buf + pos, in->len - pos);
+  in->len -= pos;
+  statRecord(STAT_DECODE, benchNanos() - start);
+}
+
+int editorKeyPending() //whether keys that were already read are waiting to be processed
+{
+  return !E.headless && E.input.head < E.input.nkeys; //headless, every key is timed with a frame of its own
+}
 
-  if (c == '\x1b') {
-    char seq[3];
+long editorMillis() //milliseconds on the monotonic clock
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+int editorWaitKey(int timeout) //wait up to timeout ms (-1 for ever, 0 to only take what is there) for a key, returns whether there is one
+{
+  /**Everything the terminal has sent is read in one go and decoded into a queue of keys, so a burst of keys or a
+  *paste costs one read() instead of one per byte. While waiting, the process sleeps until input arrives or the wake pipe
+  *is written to, which happens when the window is resized or the search scan has a new match count to show. In follow
+  *mode a change to the followed file also ends the wait, with a FOLLOW key.
+  */
+  struct editorInput *in = &E.input;
+  long deadline = editorMillis() + timeout;
+  while (in->head == in->nkeys)
+  {
+    int wait = timeout < 0 ? -1 : (int)(deadline - editorMillis());
+    if (timeout >= 0 && wait < 0) wait = 0;
+    int escwait = in->len && !in->pasting && (wait < 0 || wait > KILO_ESC_TIMEOUT); //only the rest of an escape sequence is waited for with a timeout
+    if (escwait) wait = KILO_ESC_TIMEOUT;
+    int followwait = !escwait && E.follow.on && E.follow.notifyfd == -1 && (wait < 0 || wait > KILO_FOLLOW_POLL); //without inotify the file is looked at on a timer
+    if (followwait) wait = KILO_FOLLOW_POLL;
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    struct pollfd fds[3];
+    fds[0].fd = E.infd;
+    fds[0].events = POLLIN;
+    fds[1].fd = in->wakefd[0];
+    fds[1].events = POLLIN;
+    fds[2].fd = E.follow.on ? E.follow.notifyfd : -1; //poll() skips a negative descriptor
+    fds[2].events = POLLIN;
+    int n = poll(fds, 3, wait);
+    if (n == -1)
+    {
+      if (errno != EINTR) die("poll");
+      continue;
+    }
+    int follow = followwait && n == 0;
+    if (n == 0 && !follow)
+    {
+      if (!escwait) return 0;
+      editorDecodeInput(1); //the rest of the sequence never came: it was the ESC key
+      continue;
+    }
 
-    if (seq[0] == '[') 
+    if (fds[1].revents & POLLIN)
+    {
+      char drain[64];
+      while (read(in->wakefd[0], drain, sizeof(drain)) > 0);
+      if (E.hangup) exit(1);
+      journalPump(); //the writer thread made room for records that were waiting
+      if (E.resized || searchScanProgress()) editorRefreshScreen(); //repaint for a new window size or match count without waiting for a key
+      if (E.follow.pending) follow = 1; //followPump() left text to read in the next frame
+    }
+    if (fds[2].revents & POLLIN)
     {
-      if (seq[1] >= '0' && seq[1] <= '9') 
+      char drain[4096]; //the events themselves do not matter, the file is looked at again whatever they say
+      while (read(E.follow.notifyfd, drain, sizeof(drain)) > 0);
+      follow = 1;
+    }
+    if (fds[0].revents)
+    {
+      if (in->len == KILO_INPUT_BUF) editorDecodeInput(1); //an endless sequence: give up on it rather than stall
+      int nread = read(E.infd, in->buf + in->len, KILO_INPUT_BUF - in->len);
+      if (nread == 0 && E.headless) //the end of the trace, which counts as quitting
       {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~') 
-        {
-          switch (seq[1]) 
-          {
-            case '1': return HOME_KEY;
-            case '3': return DEL_KEY;
-            case '4': return END_KEY;
-            case '5': return PAGE_UP;
-            case '6': return PAGE_DOWN;
-            case '7': return HOME_KEY;
-            case '8': return END_KEY;
-          }
-        }
-      } 
-      else 
+        E.journal.discard = 1;
+        exit(0);
+      }
+      if (nread == 0 || (nread == -1 && errno != EAGAIN && errno != EINTR)) die("read");
+      if (nread > 0)
       {
-        switch (seq[1]) {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          case 'H': return HOME_KEY;
-          case 'F': return END_KEY;
-        }
+        in->len += nread;
+        editorDecodeInput(0);
       }
-    } 
-    else if (seq[0] == 'O') 
+    }
+    if (follow)
     {
-      switch (seq[1]) 
+      E.follow.pending = 1;
+      if (in->head == in->nkeys) //no other key to wake the main loop with
       {
-        case 'H': return HOME_KEY;
-        case 'F': return END_KEY;
+        in->head = 0;
+        in->nkeys = 1;
+        in->keys[0] = FOLLOW;
       }
     }
+  }
+  return 1;
+}
 
-    return '\x1b';
-  } 
-  else 
+int editorReadKey() //the next key, sleeping in poll() until there is one
+{
+  if (E.headless) benchKeyDone(); //asking for a key means the last one has been handled and drawn
+  statEditDone();
+  editorWaitKey(-1);
+  if (E.headless) benchKeyStart();
+  statEditStart();
+  struct editorInput *in = &E.input;
+  int key = in->keys[in->head++];
+  if (key == PASTE) //point at its text, which stays put until the next read is decoded
   {
-    return c;
+    in->pastefrom = in->pastehead ? in->pasteend[in->pastehead - 1] : 0;
+    in->pasteto = in->pasteend[in->pastehead++];
   }
+  return key;
 }
 
 int getCursorPosition(int *rows, int *cols) 
@@ -194,6 +857,10 @@ int getCursorPosition(int *rows, int *cols)
 
   while (i < sizeof(buf) - 1) 
   {
+    struct pollfd pfd;
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 1000) != 1) break; //reads do not wait in raw mode, the terminal gets a second to answer
     if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
     if (buf[i] == 'R') break;
     i++;
@@ -222,357 +889,4843 @@ int getWindowSize(int *rows, int *cols)
 }
 
 /*-------------------------------------------------------------------------------------------------------------------------------*/
-/******************************************************** Row Operations *********************************************************/
+/******************************************************** Row Memory *************************************************************/
 /*-------------------------------------------------------------------------------------------------------------------------------*/
+/**A file of millions of short lines would spend more on malloc() headers and fragmentation than on its text if every row
+*had buffers of its own. Text that comes in bulk, a file that could not be mapped or a paste, is copied into large arena
+*blocks instead, and its rows are views into them just like the rows of a mapped file. A block counts the rows that view
+*it and is freed when the last one is edited or deleted. An edited row copies its text into a buffer from a slab: buffers
+*come in power-of-two size classes from KILO_SLAB_MIN up, carved out of KILO_SLAB_PAGE pages, and a buffer that is given
+*back goes on a free list of its class for the next row. A row's gap grows to fill the class, so the rounding is room to
+*type in rather than waste. The highlight, render and column index buffers of the rows come from the slabs too.
+*/
 
-int editorRowCxToRx(erow *row, int cx)    //converts the index of a character in a row to the index of the character in the render field
+int slabClass(int size) //the size class of a buffer of size bytes, -1 when it is too large for the slabs
 {
-  int rx = 0; //render index
-  int j;  //character index
-  for (j = 0; j < cx; j++) //
+  int c = 0;
+  while (c < KILO_SLAB_CLASSES && (KILO_SLAB_MIN << c) < size)
+    c++;
+  return c < KILO_SLAB_CLASSES ? c : -1;
+}
+
+void *slabAlloc(int *size) //a buffer of at least *size bytes; *size is set to what the buffer really holds
+{
+  struct rowMemory *m = &E.mem;
+  int c = slabClass(*size);
+  if (c == -1)
+  {
+    m->heap += *size;
+    return xmalloc(*size);
+  }
+  *size = KILO_SLAB_MIN << c;
+  m->slabused += *size;
+  char *p = m->slabfree[c];
+  if (p)
+  {
+    memcpy(&m->slabfree[c], p, sizeof(char *)); //unlink it from the free list
+    return p;
+  }
+  if (m->slabnext[c] == m->slabend[c])
   {
-    if (row->chars[j] == '\t') //if the character is a tab, increment rx to the next tab stop
-      rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP); 
-    rx++; 
+    m->slabnext[c] = xmalloc(KILO_SLAB_PAGE);
+    m->slabend[c] = m->slabnext[c] + KILO_SLAB_PAGE;
+    m->slabpages += KILO_SLAB_PAGE;
   }
-  return rx; 
+  p = m->slabnext[c];
+  m->slabnext[c] += *size;
+  return p;
 }
 
-int editorRowRxtoCx(erow *row, int rx)
+void slabFree(void *p, int size) //give back a buffer of size bytes, as set by slabAlloc()
 {
-  /**To convert an rx into a cx, we do pretty much the same thing when converting the other way: 
-  *loop through the chars string, calculating the current rx value (cur_rx) as we go. 
-  *But instead of stopping when we hit a particular cx value and returning cur_rx, 
-  *we want to stop when cur_rx hits the given rx value and return cx.
-  */
-  int cur_rx = 0; //current render index
-  int cx; //current character index
-  for(cx = 0; cx < row->size; cx++) //loop through the chars of the row
+  struct rowMemory *m = &E.mem;
+  if (!p) return;
+  int c = slabClass(size);
+  if (c == -1)
   {
-    if(row->chars[cx] == '\t')    //if the character is a tab, increment cur_rx to the next tab stop
-    {
-      cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP); 
-    }
-    cur_rx++; 
-    if(cur_rx > rx) return cx;
+    m->heap -= size;
+    free(p);
+    return;
   }
-  return cx; //return the character index
+  m->slabused -= size;
+  memcpy(p, &m->slabfree[c], sizeof(char *));
+  m->slabfree[c] = p;
 }
 
-void editorUpdateRow(erow *row)           //converts each tab character in a row to spaces, so that when we draw the row to the screen, the tabs will be displayed correctly.
+void *slabRealloc(void *p, int size, int *newsize) //move a buffer of size bytes into one of at least *newsize, keeping what fits
 {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++) //loop through the chars of the row again, and this time copy the chars to render, replacing tabs with spaces
-    if (row->chars[j] == '\t') tabs++;
-
-  free(row->render);
-  row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+  int c = slabClass(*newsize);
+  if (p && c == -1 && slabClass(size) == -1)
+  {
+    E.mem.heap += *newsize - size;
+    return xrealloc(p, *newsize);
+  }
+  if (p && c != -1 && c == slabClass(size)) //still the same class
+  {
+    *newsize = size;
+    return p;
+  }
+  void *q = slabAlloc(newsize);
+  if (p) memcpy(q, p, size < *newsize ? size : *newsize);
+  slabFree(p, size);
+  return q;
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) //loop through the chars of the row again, and this time copy the chars to render, replacing tabs with spaces
+arenaBlock *arenaFind(const char *p) //the arena block that p points into, NULL when it is not in one
+{
+  struct rowMemory *m = &E.mem;
+  int lo = 0, hi = m->nblocks;
+  while (lo < hi) //the first block that starts after p
   {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
-    }
+    int mid = (lo + hi) / 2;
+    if (m->blocks[mid].base <= p) lo = mid + 1;
+    else hi = mid;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  if (lo == 0 || p >= m->blocks[lo - 1].base + m->blocks[lo - 1].len) return NULL;
+  return &m->blocks[lo - 1];
 }
 
-void editorInsertRow(int at, char *s, size_t len) //insert a row at a given index
+arenaBlock *arenaAdd(char *base, size_t len, size_t used) //make a block of len bytes at base, the first used of them taken
 {
-  if(at < 0 || at > E.numrows) return;
+  struct rowMemory *m = &E.mem;
+  if (m->nblocks == m->blockscap)
+  {
+    m->blockscap = m->blockscap ? m->blockscap * 2 : 16;
+    m->blocks = xrealloc(m->blocks, sizeof(arenaBlock) * m->blockscap);
+  }
+  int at = m->nblocks;
+  while (at > 0 && m->blocks[at - 1].base > base)
+    at--;
+  memmove(&m->blocks[at + 1], &m->blocks[at], sizeof(arenaBlock) * (m->nblocks - at));
+  m->nblocks++;
+  m->arena += len;
+  arenaBlock *b = &m->blocks[at];
+  b->base = base;
+  b->len = len;
+  b->used = used;
+  b->rows = 0;
+  return b;
+}
 
-  E.row = realloc(E.row, sizeof(erow)*(E.numrows + 1)); 
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+void arenaHold(const char *p, long rows) //rows more (or fewer) rows are views into the block that p points into
+{
+  struct rowMemory *m = &E.mem;
+  arenaBlock *b = arenaFind(p);
+  if (!b) return; //the file mapping
+  b->rows += rows;
+  if (b->rows > 0) return;
+  if (b->base == m->fill) //nothing in the block is used any more, start it over
+  {
+    b->used = 0;
+    return;
+  }
+  free(b->base);
+  m->arena -= b->len;
+  m->nblocks--;
+  memmove(b, b + 1, sizeof(arenaBlock) * (m->nblocks - (b - m->blocks)));
+}
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+char *arenaAlloc(size_t len) //room for len bytes of bulk text, whose rows then hold on to it with arenaHold()
+{
+  struct rowMemory *m = &E.mem;
+  arenaBlock *b = m->fill ? arenaFind(m->fill) : NULL;
+  if (!b || b->len - b->used < len)
+  {
+    if (b)
+    {
+      m->fill = NULL;
+      arenaHold(b->base, 0); //the block being replaced goes if none of it is in use
+    }
+    size_t size = len > KILO_ARENA_BLOCK ? len : KILO_ARENA_BLOCK;
+    b = arenaAdd(xmalloc(size), size, 0);
+    m->fill = b->base;
+  }
+  char *p = b->base + b->used;
+  b->used += len;
+  return p;
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdateRow(&E.row[at]);
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Row Storage ************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**The rows live in a rope: a treap of leaves, each leaf holding up to KILO_ROPE_LEAF_MAX consecutive rows.
+*Every node caches the number of rows in its subtree, so finding row N, inserting a row and deleting a row
+*all cost O(log n) plus a memmove inside one small leaf, instead of moving the whole row array.
+*Pointers returned by editorRow() stay valid until a row is inserted into or deleted from the same leaf.
+*/
 
-  E.numrows++; //increment the number of rows in the editor
-  E.dirty++; //increment the dirty flag, to indicate that the file has been modified
+int ropeCount(rnode *t) //number of rows in a subtree
+{
+  return t ? t->count : 0;
 }
 
-void editorFreeRow(erow *row) //free the memory used by a row
+void ropeUpdate(rnode *t) //recompute the cached row count of a node from its children
 {
-  free(row->render);
-  free(row->chars);
+  t->count = ropeCount(t->left) + t->n + ropeCount(t->right);
 }
 
-void editorDelRow(int at) //delete a row at a given index
+rnode *ropeNewLeaf() //allocate an empty leaf
 {
-  if(at < 0 || at >= E.numrows) return; 
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at +1], sizeof(erow)*(E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+  rnode *t = xmalloc(sizeof(rnode));
+  t->left = NULL;
+  t->right = NULL;
+  t->prio = rand();
+  t->count = 0;
+  t->n = 0;
+  t->rows = NULL;
+  t->line0 = -1;
+  t->touched = 0;
+  return t;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) //insert a character into a row at a given index 
+void editorMappedLine(int line, char **s, int *len) //locate a line of the file mapping, without its line ending
 {
-  if(at < 0 || at >row->size) at = row->size; //if at is negative, set it to the end of the row. If it is greater than the size of the row, set it to the end of the row.
-  row->chars = realloc(row->chars, row->size + 2); //allocate memory for one more character
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1); //shift the characters after the insertion point to the right by one
-  //memmove() comes from <string.h>. It is like memcpy(), but is safe to use when the source and destination arrays overlap.
-  row->size++;
-  row->chars[at] = c; //insert the character at the insertion point
-  editorUpdateRow(row); //update the render field of the row to reflect the change
+  size_t start = line ? E.lineend[line - 1] + 1 : 0;
+  size_t end = E.lineend[line];
+  if (end < E.maplen && end > start && E.map[end - 1] == '\r') //only the \r of a \r\n is part of the line ending
+    end--;
+  *s = E.map + start;
+  *len = end - start;
 }
 
-/*-------------------------------------------------------------------------------------------------------------------------------*/
-/******************************************************** Editor Operations ******************************************************/
-/*-------------------------------------------------------------------------------------------------------------------------------*/
-void editorInsertChar(int c) //insert a character at the cursor position
+size_t ropeMappedText(rnode *t, int from, int to) //bytes of text the lines [from, to) of a leaf that was never built hold
 {
-  if(E.cy == E.numrows) //if the cursor is on the last row, append a new row to the end of the file
+  int eollen = E.crlf ? 2 : 1;
+  size_t start = t->line0 + from ? E.lineend[t->line0 + from - 1] + 1 : 0;
+  size_t end = E.lineend[t->line0 + to - 1];
+  if (!E.eolmixed) //the run less the line endings, which are all eol but that of a last line without a newline
+    return end - start - (to - from - 1) * eollen - (E.crlf && end < E.maplen);
+  size_t text = 0;
+  int j;
+  for (j = from; j < to; j++)
   {
-    editorInsertRow(E.numrows,"", 0); //append a new row to the end of the file
+    char *s;
+    int len;
+    editorMappedLine(t->line0 + j, &s, &len);
+    text += len;
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c); //insert the character at the cursor position
-  E.cx++; //move the cursor to the right
-  E.dirty++; //increment the dirty flag, to indicate that the file has been modified
+  return text;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) //append a string to the end of a row
+erow *ropeLeafRows(rnode *t) //make sure the rows of a leaf exist, building them from the file mapping on first use
 {
-  row->chars = realloc(row->chars, row->size + len + 1); 
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+  if (t->rows) return t->rows;
+  t->rows = xmalloc(sizeof(erow) * KILO_ROPE_LEAF_MAX);
+  if (t->line0 < 0) return t->rows;
+
+  int j;
+  for (j = 0; j < t->n; j++) //mapped rows are views into the file until they are edited
+  {
+    char *s;
+    int len;
+    editorMappedLine(t->line0 + j, &s, &len);
+    editorRowInit(&t->rows[j], s, len, 0, E.linetabs[t->line0 + j], ROW_MAPPED); //the tab count comes from the line scan
+  }
+  t->line0 = -1;
+  return t->rows;
 }
 
-/*
-*editorInsertChar() doesn’t have to worry about the details of modifying an erow, and editorRowInsertChar() doesn’t have to worry about where the cursor is. 
-*That is the difference between functions in the  editor operations  section and functions in the row operations section.
-*/
-void editorRowDelChar(erow *row, int at) //delete a character from a row
+rnode *ropeMerge(rnode *a, rnode *b) //join two ropes, every row of a comes before every row of b
 {
-  if(at < 0 || at >= row->size) return; //If the cursor’s past the end of the file, then there is nothing to delete, and we return immediately
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at); //shift the characters after the deletion point to the left by one
-  row->size--; //decrement the size of the row
-  editorUpdateRow(row); //update the render field of the row to reflect the change
-  
-  E.dirty++; //increment the dirty flag, to indicate that the file has been modified
+  if (!a) return b;
+  if (!b) return a;
+  if (a->prio > b->prio)
+  {
+    a->right = ropeMerge(a->right, b);
+    ropeUpdate(a);
+    return a;
+  }
+  b->left = ropeMerge(a, b->left);
+  ropeUpdate(b);
+  return b;
 }
 
-void editorInsertNewline() //insert a newline at the cursor position
+void ropeSplit(rnode *t, int k, rnode **a, rnode **b) //split a rope into the leaves that end at or before row k, and the rest
 {
-  if(E.cx == 0)
+  if (!t)
   {
-    editorInsertRow(E.cy, "", 0);
+    *a = *b = NULL;
+    return;
+  }
+  int leftcnt = ropeCount(t->left);
+  if (leftcnt + t->n <= k)
+  {
+    ropeSplit(t->right, k - leftcnt - t->n, &t->right, b);
+    *a = t;
   }
   else
   {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    ropeSplit(t->left, k, a, &t->left);
+    *b = t;
   }
-  E.cy++;
-  E.cx = 0;
+  ropeUpdate(t);
+}
+
+rnode *ropeDescend(int at, int *idx, int insert, int delta) //find the leaf of row 'at' and add delta to the counts on the way down
+{
+  /**With insert set, 'at' may also be one past the last row of a leaf, which is where an appended row goes.
+  **idx receives the position of the row inside the leaf.
+  */
+  rnode *t = E.rope;
+  while (t)
+  {
+    int leftcnt = ropeCount(t->left);
+    t->count += delta;
+    if (at < leftcnt)
+    {
+      t = t->left;
+    }
+    else if (at < leftcnt + t->n + (insert ? 1 : 0))
+    {
+      *idx = at - leftcnt;
+      return t;
+    }
+    else
+    {
+      at -= leftcnt + t->n;
+      t = t->right;
+    }
+  }
+  return NULL;
+}
+
+rnode *ropeIsolate(int start, int n, rnode **a, rnode **c) //cut the leaf of n rows starting at row 'start' out of the rope
+{
+  rnode *b;
+  ropeSplit(E.rope, start, a, &b);
+  ropeSplit(b, n, &b, c);
+  return b;
+}
+
+erow *editorRow(int at) //get a pointer to the row at a given index
+{
+  int idx;
+  if (at < 0 || at >= E.numrows) return NULL;
+  rnode *leaf = ropeDescend(at, &idx, 0, 0);
+  leaf->touched = 1; //the caller may edit the row
+  return &ropeLeafRows(leaf)[idx];
+}
+
+void ropeLineText(rnode *leaf, int idx, char **s, int *len) //get the text of a row of a leaf without building the leaf
+{
+  if (!leaf->rows && leaf->line0 >= 0)
+  {
+    editorMappedLine(leaf->line0 + idx, s, len);
+    return;
+  }
+  erow *row = &ropeLeafRows(leaf)[idx];
+  *s = editorRowFlat(row);
+  *len = row->size;
+}
+
+void editorLineText(int at, char **s, int *len) //get the text of a line without building the rows of its leaf
+{
+  int idx;
+  rnode *leaf = ropeDescend(at, &idx, 0, 0);
+  ropeLineText(leaf, idx, s, len);
+}
+
+void ropeSplitLeaf(rnode *leaf, int start, int k) //move the rows of a leaf from index k on into a new leaf right after it
+{
+  /**start is the index of the leaf's first row in the file.*/
+  rnode *a, *c;
+  ropeLeafRows(leaf);
+  ropeIsolate(start, leaf->n, &a, &c);
+  rnode *next = ropeNewLeaf();
+  memcpy(ropeLeafRows(next), &leaf->rows[k], sizeof(erow) * (leaf->n - k));
+  next->n = leaf->n - k;
+  next->touched = leaf->touched;
+  leaf->n = k;
+  ropeUpdate(leaf);
+  ropeUpdate(next);
+  E.rope = ropeMerge(ropeMerge(a, ropeMerge(leaf, next)), c);
+}
+
+void ropeInsertRope(int at, rnode *t) //insert a rope of new leaves, so that its first row becomes row 'at'
+{
+  int idx;
+  rnode *a, *c;
+  if (at < ropeCount(E.rope))
+  {
+    rnode *leaf = ropeDescend(at, &idx, 0, 0);
+    if (idx > 0) ropeSplitLeaf(leaf, at - idx, idx); //row 'at' has to start a leaf for the rope to be cut right before it
+  }
+  ropeSplit(E.rope, at, &a, &c);
+  E.rope = ropeMerge(ropeMerge(a, t), c);
+}
+
+rnode *ropeBuild(char *s, lineScan *scan, int strip) //new leaves of rows that are views of the lines of s, which is arena text
+{
+  /**The lines are the ones a scan with tab counts found. With strip set, the \r's that end a line are dropped, as they
+  *are when a file is read.
+  */
+  rnode *rope = NULL, *leaf = NULL;
+  size_t j, start = 0;
+  long views = 0;
+  for (j = 0; j < scan->n; j++)
+  {
+    if (!leaf || leaf->n == KILO_ROPE_LEAF_MAX)
+    {
+      if (leaf) rope = ropeMerge(rope, leaf);
+      leaf = ropeNewLeaf();
+      ropeLeafRows(leaf);
+    }
+    size_t end = scan->end[j];
+    while (strip && end > start && s[end - 1] == '\r')
+      end--;
+    if (end > start) views++; //an empty row views nothing, and holds on to no block
+    editorRowInit(&leaf->rows[leaf->n++], end > start ? s + start : (char *)"", end - start, 0, scan->tabs[j], ROW_MAPPED);
+    ropeUpdate(leaf);
+    start = scan->end[j] + 1;
+  }
+  if (leaf) rope = ropeMerge(rope, leaf);
+  arenaHold(s, views);
+  return rope;
+}
+
+void ropeInsert(int at, erow *row) //insert a copy of *row into the rope at a given index
+{
+  int idx;
+  if (!E.rope) E.rope = ropeNewLeaf();
+
+  rnode *leaf = ropeDescend(at, &idx, 1, 0);
+  ropeLeafRows(leaf);
+  while (leaf->n == KILO_ROPE_LEAF_MAX) //the leaf is full: move its second half into a new leaf right after it
+  {
+    ropeSplitLeaf(leaf, at - idx, leaf->n / 2);
+    leaf = ropeDescend(at, &idx, 1, 0); //a row at the boundary may now fall in the full leaf next door
+    ropeLeafRows(leaf);
+  }
+
+  leaf = ropeDescend(at, &idx, 1, 1);
+  memmove(&leaf->rows[idx + 1], &leaf->rows[idx], sizeof(erow) * (leaf->n - idx));
+  leaf->rows[idx] = *row;
+  leaf->n++;
+}
+
+void ropeDelete(int at) //remove the row at a given index from the rope, the caller frees its contents
+{
+  int idx;
+  rnode *leaf = ropeDescend(at, &idx, 0, 0);
+  ropeLeafRows(leaf);
+  if (leaf->n == 1) //the leaf becomes empty: drop it from the treap
+  {
+    rnode *a, *c;
+    ropeIsolate(at, 1, &a, &c);
+    free(leaf->rows);
+    free(leaf);
+    E.rope = ropeMerge(a, c);
+    return;
+  }
+  leaf = ropeDescend(at, &idx, 0, -1);
+  memmove(&leaf->rows[idx], &leaf->rows[idx + 1], sizeof(erow) * (leaf->n - idx - 1));
+  leaf->n--;
+}
+
+void ropeFree(rnode *t) //free a rope and every row in it
+{
+  if (!t) return;
+  ropeFree(t->left);
+  ropeFree(t->right);
+  int j;
+  for (j = 0; t->rows && j < t->n; j++)
+    editorFreeRow(&t->rows[j]);
+  free(t->rows);
+  free(t);
+}
+
+/**Byte offsets are found through a sparse index of where every KILO_CHECKPOINT_LINES-th line starts in the file as it
+*would be saved. An edit makes the checkpoints after the row it touched out of date, and they are only worked out again
+*when an offset past them is asked for, by walking the rope on from the last good one. A leaf whose rows were never
+*built knows its size from the line index of the mapping, so the walk adds up rows one by one only where the file was
+*edited or read from a pipe, and it never builds a leaf.
+*/
+
+long long ropeLeafBytes(rnode *t, int from, int to) //bytes the rows [from, to) of a leaf take in the file as it would be saved
+{
+  if (from >= to) return 0;
+  int eollen = E.crlf ? 2 : 1;
+  if (!t->rows && t->line0 >= 0) //each line gets eol, as saveRows() writes it
+    return ropeMappedText(t, from, to) + (long long)(to - from) * eollen;
+  long long bytes = 0;
+  int j;
+  for (j = from; j < to; j++)
+    bytes += t->rows[j].size + eollen;
+  return bytes;
+}
+
+void checkpointAdd(long long off) //append the next checkpoint
+{
+  struct lineCheckpoints *c = &E.checkpoints;
+  if (c->n == c->cap)
+  {
+    c->cap = c->cap ? c->cap * 2 : 1024;
+    c->off = xrealloc(c->off, sizeof(long long) * c->cap);
+  }
+  c->off[c->n++] = off;
+}
+
+void checkpointInvalidate(int at) //the text of row 'at' changed, or rows were inserted or deleted there
+{
+  if (E.checkpoints.n > at / KILO_CHECKPOINT_LINES + 1) E.checkpoints.n = at / KILO_CHECKPOINT_LINES + 1;
+}
+
+void checkpointWalk(rnode *t, int first, lineWalk *w) //walk the rows of subtree t, whose first row is 'first', from row w->at on
+{
+  /**Subtrees that end before w->at are skipped, so a walk costs O(log n) plus the leaves it crosses. Rows are taken up
+  *to the next checkpoint at a time, and one at a time once the target is among them. The checkpoints passed beyond the
+  *last one that is up to date are added to the index.
+  */
+  if (!t || w->at >= w->stop) return;
+  int left = first + ropeCount(t->left), end = left + t->n;
+  if (w->at < left) checkpointWalk(t->left, first, w);
+  while (w->at >= left && w->at < end && w->at < w->stop)
+  {
+    int next = (w->at / KILO_CHECKPOINT_LINES + 1) * KILO_CHECKPOINT_LINES;
+    if (next > end) next = end;
+    if (next > w->stop) next = w->stop;
+    long long bytes = ropeLeafBytes(t, w->at - left, next - left);
+    if (w->target >= 0 && w->off + bytes > w->target)
+    {
+      bytes = ropeLeafBytes(t, w->at - left, w->at - left + 1);
+      if (w->off + bytes > w->target) //found it
+      {
+        w->stop = w->at;
+        return;
+      }
+      next = w->at + 1;
+    }
+    w->off += bytes;
+    w->at = next;
+    if (w->at % KILO_CHECKPOINT_LINES == 0 && w->at / KILO_CHECKPOINT_LINES == E.checkpoints.n) checkpointAdd(w->off);
+  }
+  if (w->at >= end) checkpointWalk(t->right, end, w);
+}
+
+int editorOffsetRow(long long byte, int *col) //the row that holds a byte offset of the file as it would be saved, and the offset in it
+{
+  struct lineCheckpoints *c = &E.checkpoints;
+  if (c->n == 0) checkpointAdd(0);
+  int lo = 0, hi = c->n - 1;
+  while (lo < hi) //the last checkpoint at or before the offset
+  {
+    int mid = (lo + hi + 1) / 2;
+    if (c->off[mid] <= byte) lo = mid;
+    else hi = mid - 1;
+  }
+  lineWalk w = {lo * KILO_CHECKPOINT_LINES, c->off[lo], E.numrows, byte};
+  checkpointWalk(E.rope, 0, &w);
+  if (w.at >= E.numrows) //past the end of the file: the end of the last row
+  {
+    *col = INT_MAX;
+    return E.numrows > 0 ? E.numrows - 1 : 0;
+  }
+  *col = byte - w.off;
+  return w.at;
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Syntax Highlighting ****************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**Every row keeps the highlight class of each of its characters, the lexer state it was highlighted from and the state
+*it ends in, such as "inside a block comment". A row only has to be lexed again when its text changed or the state it
+*starts in did. After an edit the rows are redone from the edited one on, and that stops by itself where a row starts in
+*the same state as last time, since every row after it will too. Only rows on the screen are highlighted: E.hlvalid
+*tracks how far the highlights agree from the top of the file, and when the screen is far below that, the state is
+*guessed by lexing the KILO_SYNTAX_LOOKBACK rows above it instead of the whole file.
+*Rows of KILO_LONG_LINE characters or more are the same idea one level down: such a row is split into chunks, and the
+*state of the lexer is kept where each chunk starts. Only the classes of the characters around the screen are kept, lexed
+*from the start of the chunk they are in, so an edit in a row of hundreds of megabytes costs a chunk or two of lexing.
+*/
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".cc", ".cxx", ".hpp", ".hh", ".hxx", NULL};
+char *C_HL_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else", "do", "goto", "case", "default",
+  "struct", "union", "typedef", "static", "enum", "class", "namespace", "template", "typename", "using",
+  "public", "private", "protected", "virtual", "override", "friend", "operator", "new", "delete", "this",
+  "try", "catch", "throw", "sizeof", "extern", "inline", "const", "constexpr", "volatile", "register",
+  "nullptr", "true", "false", "NULL",
+  "#include", "#define", "#undef", "#if", "#ifdef", "#ifndef", "#elif", "#else", "#endif", "#pragma", "#error",
+
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|", "void|", "short|", "bool|", "auto|",
+  "size_t|", "ssize_t|", "int8_t|", "int16_t|", "int32_t|", "int64_t|", "uint8_t|", "uint16_t|", "uint32_t|",
+  "uint64_t|", "wchar_t|", NULL
+};
+
+char *JSON_HL_extensions[] = {".json", NULL};
+char *JSON_HL_keywords[] = {"true", "false", "null", NULL};
+
+char *LOG_HL_extensions[] = {".log", "syslog", NULL};
+char *LOG_HL_keywords[] = {
+  "FATAL", "CRITICAL", "ERROR", "SEVERE", "FAIL", "FAILED",
+  "WARN|", "WARNING|", "NOTICE|", "INFO|", "DEBUG|", "TRACE|", NULL
+};
+
+struct editorSyntax HLDB[] = //the highlight database, one entry per type of file
+{
+  {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/", "\"'", HL_HIGHLIGHT_NUMBERS},
+  {"json", JSON_HL_extensions, JSON_HL_keywords, NULL, NULL, NULL, "\"", HL_HIGHLIGHT_NUMBERS},
+  {"log", LOG_HL_extensions, LOG_HL_keywords, NULL, NULL, NULL, "\"", HL_HIGHLIGHT_NUMBERS},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+int editorIsSeparator(int c) //whether a character separates words, numbers and keywords
+{
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[]{};:&|!^?", c) != NULL;
+}
+
+int editorSyntaxMatch(const char *s, int len, int i, const char *word, int wordlen) //whether word is in s at index i
+{
+  return wordlen > 0 && i + wordlen <= len && memcmp(&s[i], word, wordlen) == 0;
+}
+
+int editorLex(const char *s, int size, int i, int end, unsigned char *hl, hlLexer *st) //lex the characters of s from index i
+{                                                                                      //to end, of size in all, from state st
+  /**The class of each character goes into hl[i], which has to be filled with HL_NORMAL beforehand. The lexer may read up
+  *to KILO_LEX_AHEAD characters past end, and it stops past end when a token crosses it; it returns where it stopped,
+  *with st the state there. A row is lexed in one go with end its size, a long row a chunk at a time.
+  */
+  struct editorSyntax *syn = E.syntax;
+  char **keywords = syn->keywords;
+  char *scs = syn->singleline_comment_start;
+  char *mcs = syn->multiline_comment_start;
+  char *mce = syn->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  int start = i;
+  while (i < end)
+  {
+    unsigned char c = s[i];
+    if (i > start) st->number = hl[i - 1] == HL_NUMBER;
+
+    if (st->comment == HLS_LINE_COMMENT) //the rest of the line is a comment
+    {
+      memset(&hl[i], HL_COMMENT, end - i);
+      i = end;
+      break;
+    }
+
+    if (!st->string && st->comment != HLS_COMMENT && editorSyntaxMatch(s, size, i, scs, scs_len))
+    {
+      st->comment = HLS_LINE_COMMENT;
+      continue;
+    }
+
+    if (mcs_len && mce_len && !st->string)
+    {
+      if (st->comment == HLS_COMMENT)
+      {
+        if (editorSyntaxMatch(s, size, i, mce, mce_len))
+        {
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          st->comment = HLS_NORMAL;
+          st->sep = 1;
+        }
+        else
+        {
+          hl[i++] = HL_MLCOMMENT;
+        }
+        continue;
+      }
+      else if (editorSyntaxMatch(s, size, i, mcs, mcs_len))
+      {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        st->comment = HLS_COMMENT;
+        continue;
+      }
+    }
+
+    if (syn->quotes)
+    {
+      if (st->string)
+      {
+        hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < size) //an escaped character never ends the string
+        {
+          hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        if (c == st->string) st->string = 0;
+        i++;
+        st->sep = 1;
+        continue;
+      }
+      else if (c && strchr(syn->quotes, c))
+      {
+        st->string = c;
+        hl[i++] = HL_STRING;
+        continue;
+      }
+    }
+
+    if (syn->flags & HL_HIGHLIGHT_NUMBERS)
+    {
+      if ((isdigit(c) && (st->sep || st->number)) || (c == '.' && st->number))
+      {
+        hl[i++] = HL_NUMBER;
+        st->sep = 0;
+        continue;
+      }
+    }
+
+    if (st->sep) //a keyword has to start after a separator and be followed by one
+    {
+      int j;
+      for (j = 0; keywords[j]; j++)
+      {
+        if ((unsigned char)keywords[j][0] != c) continue; //most keywords are ruled out by their first letter
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2) klen--;
+        if (editorSyntaxMatch(s, size, i, keywords[j], klen) && (i + klen == size || editorIsSeparator((unsigned char)s[i + klen])))
+        {
+          memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          i += klen;
+          break;
+        }
+      }
+      if (keywords[j] != NULL)
+      {
+        st->sep = 0;
+        continue;
+      }
+    }
+
+    st->sep = editorIsSeparator(c);
+    i++;
+  }
+  if (i > start) st->number = hl[i - 1] == HL_NUMBER;
+  return i;
+}
+
+void editorRowHlReserve(erow *row, int len) //make sure hl can hold len classes
+{
+  if (row->hl && row->hlcap >= len) return;
+  int cap = len > KILO_SLAB_MIN ? len : KILO_SLAB_MIN;
+  row->hl = slabRealloc(row->hl, row->hlcap, &cap);
+  row->hlcap = cap;
+}
+
+void editorLongFree(erow *row) //forget the chunks of a long row
+{
+  if (!row->longhl) return;
+  free(row->longhl->chunks);
+  free(row->longhl);
+  row->longhl = NULL;
+}
+
+int editorLongLex(erow *row, int from, int to, hlLexer *st) //lex the characters [from, to) of a long row into hl, which then
+{                                                            //holds the classes from index from on; returns where it stopped
+  struct abuf *text = &E.lexbuf;
+  int len = row->size - from < to - from + KILO_LEX_AHEAD ? row->size - from : to - from + KILO_LEX_AHEAD;
+  text->len = 0;
+  if (abReserve(text, len) == -1) return to;
+  editorRowCopy(row, from, len, text->b);
+  editorRowHlReserve(row, len);
+  memset(row->hl, HL_NORMAL, len);
+  row->longhl->len = 0; //whatever hl held before is gone
+  return from + editorLex(text->b, len, 0, to - from, row->hl, st);
+}
+
+void editorLongCompact(rowLong *l) //drop the chunks that became empty or out of order; the chunk after each one is lexed again
+{
+  int k, n = 1;
+  for (k = 1; k < l->n; k++)
+  {
+    if (k < l->n - 1 && (l->chunks[k].at <= l->chunks[n - 1].at || l->chunks[k].at >= l->chunks[l->n - 1].at))
+    {
+      l->chunks[k + 1].stale = 1;
+      continue;
+    }
+    l->chunks[n++] = l->chunks[k];
+  }
+  l->n = n;
+}
+
+void editorLongSettle(erow *row, int upto) //work out again the states of the chunks of a long row up to the one upto is in
+{
+  /**A chunk whose state is not stale has the state that lexing the chunk before it gives, so after an edit only the
+  *chunks around it are lexed again, and the ones after them as long as their state comes out different. A chunk that
+  *grew past twice KILO_LONG_CHUNK, from a paste say, is split as it is lexed.
+  */
+  rowLong *l = row->longhl;
+  int k;
+  for (k = 0; k + 1 < l->n && l->chunks[k].at <= upto; k++)
+  {
+    rowChunk *c = &l->chunks[k], *next = &l->chunks[k + 1];
+    if (!next->stale) continue;
+    hlLexer st = c->lex;
+    if (next->at - c->at > 2 * KILO_LONG_CHUNK)
+    {
+      int at = editorLongLex(row, c->at, c->at + KILO_LONG_CHUNK, &st);
+      if (l->n == l->cap)
+      {
+        l->cap *= 2;
+        l->chunks = xrealloc(l->chunks, sizeof(rowChunk) * l->cap);
+      }
+      memmove(&l->chunks[k + 2], &l->chunks[k + 1], sizeof(rowChunk) * (l->n - k - 1));
+      l->n++;
+      l->chunks[k + 1].at = at;
+      l->chunks[k + 1].lex = st;
+      l->chunks[k + 1].stale = 0;
+      continue;
+    }
+    int at = editorLongLex(row, c->at, next->at, &st);
+    next->stale = 0;
+    if (at == next->at && memcmp(&st, &next->lex, sizeof(st)) == 0) continue; //as before: the chunks after it are still right
+    next->lex = st;
+    if (k + 2 < l->n) l->chunks[k + 2].stale = 1;
+    if (at != next->at) //a token ran past the start of the chunk, which now starts where the lexer stopped
+    {
+      next->at = at;
+      editorLongCompact(l);
+    }
+  }
+}
+
+void editorLongHighlight(erow *row, int state) //start highlighting a long row in the given state
+{
+  hlLexer start = {state, 0, 1, 0};
+  rowLong *l = row->longhl;
+  if (!l) //the whole row is one stale chunk, split up as it is lexed
+  {
+    l = row->longhl = xmalloc(sizeof(rowLong));
+    l->cap = 16;
+    l->chunks = xmalloc(sizeof(rowChunk) * l->cap);
+    l->n = 2;
+    l->chunks[0].at = 0;
+    l->chunks[1].at = row->size;
+    l->chunks[1].stale = 1;
+    l->len = 0;
+  }
+  if (memcmp(&l->chunks[0].lex, &start, sizeof(start)) != 0)
+  {
+    l->chunks[0].lex = start;
+    l->chunks[1].stale = 1;
+    l->len = 0;
+  }
+  editorRowHlReserve(row, 16);
+  row->hlout = HLS_NORMAL;
+  if (E.syntax->multiline_comment_start) //the next row starts in the state this one ends in: lex up to the end
+  {
+    editorLongSettle(row, row->size);
+    row->hlout = l->chunks[l->n - 1].lex.comment == HLS_COMMENT ? HLS_COMMENT : HLS_NORMAL;
+  }
+}
+
+unsigned char *editorSyntaxWindow(erow *row, int from, int to) //the classes of the characters [from, to) of a long row, which
+{                                                               //are lexed from the start of their chunk when not at hand
+  rowLong *l = row->longhl;
+  if (l->version == row->version && l->len > 0 && from >= l->from && to <= l->from + l->len) return &row->hl[from - l->from];
+  editorLongSettle(row, to);
+  int lo = 0, hi = l->n - 1;
+  while (lo < hi) //the last chunk that starts at or before from
+  {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (l->chunks[mid].at <= from) lo = mid;
+    else hi = mid - 1;
+  }
+  int end = lo + 1 < l->n ? l->chunks[lo + 1].at : row->size; //lex up to the end of a chunk, so that a short scroll needs nothing new
+  if (end < to) end = to;
+  hlLexer st = l->chunks[lo].lex;
+  int stop = editorLongLex(row, l->chunks[lo].at, end, &st);
+  l->from = l->chunks[lo].at;
+  l->len = stop - l->from;
+  l->version = row->version;
+  return &row->hl[from - l->from];
+}
+
+void editorSyntaxEdited(erow *row, int at, int removed, int added) //removed characters at index at were replaced by added ones:
+{                                                                  //move the chunks of a long row along with the text
+  rowLong *l = row->longhl;
+  if (!l) return;
+  int k, prev = 0;
+  for (k = 1; k < l->n; k++)
+  {
+    rowChunk *c = &l->chunks[k];
+    int old = c->at;
+    if (prev <= at + removed && old > at - KILO_LEX_AHEAD) c->stale = 1; //the edit is in the text lexed to get to this chunk
+    if (k == l->n - 1) c->at = row->size;
+    else if (old > at) c->at = old >= at + removed ? old + added - removed : at;
+    prev = old;
+  }
+  editorLongCompact(l);
+}
+
+void editorRowHighlight(erow *row, int state) //set the highlight class of every character of a row, starting in the given state
+{
+  if (row->size >= KILO_LONG_LINE)
+  {
+    editorLongHighlight(row, state);
+  }
+  else
+  {
+    editorLongFree(row); //the row may have been long once
+    editorRowHlReserve(row, row->size);
+    memset(row->hl, HL_NORMAL, row->size);
+    hlLexer st = {state, 0, 1, 0};
+    editorLex(editorRowFlat(row), row->size, 0, row->size, row->hl, &st);
+    row->hlout = st.comment == HLS_COMMENT ? HLS_COMMENT : HLS_NORMAL;
+  }
+  row->hlin = state;
+  row->hlversion = row->version;
+}
+
+int editorSyntaxToColor(int hl) //the foreground color of a highlight class
+{
+  switch (hl)
+  {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36; //cyan
+    case HL_KEYWORD1: return 33; //yellow
+    case HL_KEYWORD2: return 32; //green
+    case HL_STRING: return 35; //magenta
+    case HL_NUMBER: return 31; //red
+    default: return 39; //the default color
+  }
+}
+
+void editorSyntaxInvalidate(int at) //the text of row 'at' changed, or rows were inserted or deleted there
+{
+  if (at < E.hlvalid) E.hlvalid = at;
+}
+
+void editorSyntaxUpdate(int top, int bottom) //bring the highlights of the rows [top, bottom) up to date
+{
+  int at = E.hlvalid, state = HLS_NORMAL, guessed = 0;
+  if (at < top - KILO_SYNTAX_LOOKBACK) //too far to lex from the last row known to be right: start a bit above the screen
+  {
+    at = top - KILO_SYNTAX_LOOKBACK;
+    erow *row = editorRow(at);
+    if (row->hl) state = row->hlin;
+    guessed = 1;
+  }
+  else if (at > 0)
+  {
+    state = editorRow(at - 1)->hlout;
+  }
+
+  for (; at < bottom; at++)
+  {
+    erow *row = editorRow(at);
+    if (!row->hl || row->hlversion != row->version || row->hlin != state) editorRowHighlight(row, state);
+    state = row->hlout;
+  }
+  if (!guessed && bottom > E.hlvalid) E.hlvalid = bottom;
+}
+
+void editorSyntaxForget(rnode *t) //drop the highlights of every built row, when the rules change
+{
+  if (!t) return;
+  editorSyntaxForget(t->left);
+  editorSyntaxForget(t->right);
+  if (!t->rows) return;
+  int j;
+  for (j = 0; j < t->n; j++)
+  {
+    slabFree(t->rows[j].hl, t->rows[j].hlcap);
+    t->rows[j].hl = NULL;
+    t->rows[j].hlcap = 0;
+    editorLongFree(&t->rows[j]);
+  }
+}
+
+void editorSelectSyntax() //pick the highlighting rules that match the file name
+{
+  struct editorSyntax *syntax = NULL;
+  if (E.filename)
+  {
+    char *ext = strrchr(E.filename, '.');
+    unsigned int j;
+    for (j = 0; j < HLDB_ENTRIES && !syntax; j++)
+    {
+      struct editorSyntax *s = &HLDB[j];
+      int i;
+      for (i = 0; s->filematch[i]; i++)
+      {
+        int is_ext = s->filematch[i][0] == '.';
+        if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i])))
+        {
+          syntax = s;
+          break;
+        }
+      }
+    }
+  }
+  if (syntax == E.syntax) return;
+  E.syntax = syntax;
+  editorSyntaxForget(E.rope);
+  E.hlvalid = 0;
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Unicode ****************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**Text is taken to be UTF-8. A character that is not ASCII is drawn in as many columns as the terminal gives it: two
+*for East Asian wide characters and most emoji, none for combining marks and other characters that are drawn over the
+*one before them, one for the rest. Bytes that do not form a valid sequence are drawn one column each, as they are.
+*The cursor moves over and deletes whole grapheme clusters: a character with the combining marks, variation selectors
+*and zero width joiner sequences that follow it, or a pair of regional indicators (a flag).
+*/
+
+const unsigned uniZero[][2] = //characters that take no column, sorted
+{
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2}, {0x05C4, 0x05C5},
+  {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+  {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x07EB, 0x07F3},
+  {0x0816, 0x0819}, {0x081B, 0x0823}, {0x0825, 0x0827}, {0x0829, 0x082D}, {0x0859, 0x085B}, {0x08D3, 0x08E1},
+  {0x08E3, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+  {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD}, {0x09E2, 0x09E3},
+  {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A51}, {0x0A70, 0x0A71}, {0x0A75, 0x0A75}, {0x0A81, 0x0A82},
+  {0x0ABC, 0x0ABC}, {0x0AC1, 0x0AC8}, {0x0ACD, 0x0ACD}, {0x0AE2, 0x0AE3}, {0x0B01, 0x0B01}, {0x0B3C, 0x0B3C},
+  {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44}, {0x0B4D, 0x0B4D}, {0x0B56, 0x0B56}, {0x0B62, 0x0B63}, {0x0B82, 0x0B82},
+  {0x0BC0, 0x0BC0}, {0x0BCD, 0x0BCD}, {0x0C00, 0x0C00}, {0x0C3E, 0x0C40}, {0x0C46, 0x0C56}, {0x0C62, 0x0C63},
+  {0x0CBC, 0x0CBC}, {0x0CCC, 0x0CCD}, {0x0CE2, 0x0CE3}, {0x0D00, 0x0D01}, {0x0D41, 0x0D44}, {0x0D4D, 0x0D4D},
+  {0x0D62, 0x0D63}, {0x0DCA, 0x0DCA}, {0x0DD2, 0x0DD6}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+  {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD}, {0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37},
+  {0x0F39, 0x0F39}, {0x0F71, 0x0F7E}, {0x0F80, 0x0F84}, {0x0F86, 0x0F87}, {0x0F8D, 0x0FBC}, {0x0FC6, 0x0FC6},
+  {0x102D, 0x1030}, {0x1032, 0x1037}, {0x1039, 0x103A}, {0x103D, 0x103E}, {0x1058, 0x1059}, {0x105E, 0x1060},
+  {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108D, 0x108D}, {0x109D, 0x109D}, {0x1160, 0x11FF},
+  {0x135D, 0x135F}, {0x1712, 0x1714}, {0x1732, 0x1734}, {0x1752, 0x1753}, {0x1772, 0x1773}, {0x17B4, 0x17B5},
+  {0x17B7, 0x17BD}, {0x17C6, 0x17C6}, {0x17C9, 0x17D3}, {0x17DD, 0x17DD}, {0x180B, 0x180E}, {0x18A9, 0x18A9},
+  {0x1920, 0x1922}, {0x1927, 0x1928}, {0x1932, 0x1932}, {0x1939, 0x193B}, {0x1A17, 0x1A18}, {0x1A1B, 0x1A1B},
+  {0x1A56, 0x1A56}, {0x1A58, 0x1A60}, {0x1A62, 0x1A62}, {0x1A65, 0x1A6C}, {0x1A73, 0x1A7F}, {0x1AB0, 0x1AFF},
+  {0x1B00, 0x1B03}, {0x1B34, 0x1B34}, {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C}, {0x1B42, 0x1B42}, {0x1B6B, 0x1B73},
+  {0x1B80, 0x1B81}, {0x1BA2, 0x1BA5}, {0x1BA8, 0x1BA9}, {0x1BAB, 0x1BAD}, {0x1BE6, 0x1BE6}, {0x1BE8, 0x1BE9},
+  {0x1BED, 0x1BED}, {0x1BEF, 0x1BF1}, {0x1C2C, 0x1C33}, {0x1C36, 0x1C37}, {0x1CD0, 0x1CD2}, {0x1CD4, 0x1CE0},
+  {0x1CE2, 0x1CE8}, {0x1CED, 0x1CED}, {0x1CF4, 0x1CF4}, {0x1CF8, 0x1CF9}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F},
+  {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20F0}, {0x2CEF, 0x2CF1}, {0x2D7F, 0x2D7F}, {0x2DE0, 0x2DFF},
+  {0x302A, 0x302D}, {0x3099, 0x309A}, {0xA66F, 0xA672}, {0xA674, 0xA67D}, {0xA69E, 0xA69F}, {0xA6F0, 0xA6F1},
+  {0xA802, 0xA802}, {0xA806, 0xA806}, {0xA80B, 0xA80B}, {0xA825, 0xA826}, {0xA8C4, 0xA8C5}, {0xA8E0, 0xA8F1},
+  {0xA8FF, 0xA8FF}, {0xA926, 0xA92D}, {0xA947, 0xA951}, {0xA980, 0xA982}, {0xA9B3, 0xA9B3}, {0xA9B6, 0xA9B9},
+  {0xA9BC, 0xA9BD}, {0xA9E5, 0xA9E5}, {0xAA29, 0xAA2E}, {0xAA31, 0xAA32}, {0xAA35, 0xAA36}, {0xAA43, 0xAA43},
+  {0xAA4C, 0xAA4C}, {0xAA7C, 0xAA7C}, {0xAAB0, 0xAAB0}, {0xAAB2, 0xAAB4}, {0xAAB7, 0xAAB8}, {0xAABE, 0xAABF},
+  {0xAAC1, 0xAAC1}, {0xAAEC, 0xAAED}, {0xAAF6, 0xAAF6}, {0xABE5, 0xABE5}, {0xABE8, 0xABE8}, {0xABED, 0xABED},
+  {0xD7B0, 0xD7FF}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xFFF9, 0xFFFB},
+  {0x101FD, 0x101FD}, {0x102E0, 0x102E0}, {0x10376, 0x1037A}, {0x10A01, 0x10A0F}, {0x10A38, 0x10A3F},
+  {0x10AE5, 0x10AE6}, {0x10D24, 0x10D27}, {0x10F46, 0x10F50}, {0x11001, 0x11001}, {0x11038, 0x11046},
+  {0x1107F, 0x11081}, {0x110B3, 0x110B6}, {0x110B9, 0x110BA}, {0x11100, 0x11102}, {0x11127, 0x1112B},
+  {0x1112D, 0x11134}, {0x11173, 0x11173}, {0x11180, 0x11181}, {0x111B6, 0x111BE}, {0x1D167, 0x1D169},
+  {0x1D17B, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD}, {0x1D242, 0x1D244}, {0x1E8D0, 0x1E8D6},
+  {0x1E944, 0x1E94A}, {0x1F3FB, 0x1F3FF}, {0xE0001, 0xE0001}, {0xE0020, 0xE007F}, {0xE0100, 0xE01EF}
+};
+
+const unsigned uniWide[][2] = //characters that take two columns, sorted
+{
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0}, {0x23F3, 0x23F3},
+  {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+  {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA},
+  {0x26F2, 0x26F3}, {0x26F5, 0x26F5}, {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+  {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+  {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+  {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF}, {0xA960, 0xA97F}, {0xAC00, 0xD7A3},
+  {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+  {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E},
+  {0x1F191, 0x1F19A}, {0x1F200, 0x1F202}, {0x1F210, 0x1F23B}, {0x1F240, 0x1F248}, {0x1F250, 0x1F251},
+  {0x1F260, 0x1F265}, {0x1F300, 0x1F320}, {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393},
+  {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F3FA},
+  {0x1F400, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+  {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F},
+  {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC},
+  {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF},
+  {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+int uniInRanges(unsigned cp, const unsigned (*r)[2], int n) //whether cp falls in one of n sorted ranges
+{
+  int lo = 0, hi = n - 1;
+  while (lo <= hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (cp < r[mid][0]) hi = mid - 1;
+    else if (cp > r[mid][1]) lo = mid + 1;
+    else return 1;
+  }
+  return 0;
+}
+
+int uniWidth(unsigned cp) //columns a character takes on the screen
+{
+  if (cp < 0x300) return 1; //ASCII and the Latin-1 and Latin Extended letters
+  if (uniInRanges(cp, uniZero, sizeof(uniZero) / sizeof(uniZero[0]))) return 0;
+  if (uniInRanges(cp, uniWide, sizeof(uniWide) / sizeof(uniWide[0]))) return 2;
+  return 1;
+}
+
+int uniIsRegional(unsigned cp) //whether cp is a regional indicator, two of which make a flag
+{
+  return cp >= 0x1F1E6 && cp <= 0x1F1FF;
+}
+
+int uniExtends(unsigned prev, unsigned cp) //whether cp belongs to the same grapheme cluster as prev, the character before it
+{
+  return (cp >= 0x300 && uniWidth(cp) == 0) || (prev == 0x200D && cp >= 0x80); //a mark or joiner, or what a joiner joins
+}
+
+int utf8Decode(const unsigned char *s, int len, unsigned *cp) //decode the character at s, returns its length in bytes
+{
+  /**A byte that does not start a complete and valid sequence (a stray continuation byte, an overlong form, a
+  *surrogate) is taken as a character of its own, with the byte as its value.
+  */
+  static const unsigned min[5] = {0, 0, 0x80, 0x800, 0x10000};
+  unsigned c = s[0], v;
+  *cp = c;
+  if (c < 0x80) return 1;
+  int n = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2, j;
+  if (c < 0xC2 || c > 0xF4 || n > len) return 1;
+  v = c & (0x7F >> n);
+  for (j = 1; j < n; j++)
+  {
+    if ((s[j] & 0xC0) != 0x80) return 1;
+    v = v << 6 | (s[j] & 0x3F);
+  }
+  if (v < min[n] || v > 0x10FFFF || (v >= 0xD800 && v <= 0xDFFF)) return 1;
+  *cp = v;
+  return n;
+}
+
+int utf8CountLeads(const char *s, int len) //count the bytes that start a character that is not ASCII
+{
+  int n = 0, j = 0;
+#ifdef __SSE2__
+  const __m128i lead = _mm_set1_epi8((char)0xBF);
+  for (; j + 16 <= len; j += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+    unsigned high = _mm_movemask_epi8(v);
+    if (!high) continue; //16 bytes of ASCII, the common case, cost one test
+    n += __builtin_popcount(high & _mm_movemask_epi8(_mm_cmpgt_epi8(v, lead))); //signed, 0xC0-0xFF are the bytes above 0xBF that are negative
+  }
+#endif
+  for (; j < len; j++)
+    n += (unsigned char)s[j] >= 0xC0;
+  return n;
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Row Operations *********************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**The text of a row is a gap buffer. Typing and deleting happen at the gap, which follows the cursor, so a keystroke
+*only moves the bytes between the old and the new cursor position and the buffer is regrown geometrically.
+*Code that reads the text walks the two halves around the gap; editorRowFlat() closes the gap for callers that need
+*one contiguous string.
+*/
+
+void editorRowsChanged(int at) //the text of row 'at' changed, or rows were inserted or deleted there
+{
+  editorSyntaxInvalidate(at); //the highlights from there on may be different
+  checkpointInvalidate(at); //and so may the byte offsets of the lines after it
+}
+
+void editorRowInit(erow *row, char *chars, int size, int gaplen, int tabs, int flags) //fill in a new row around an existing text buffer
+{
+  row->size = size;
+  row->chars = chars;
+  row->gap = size;
+  row->gaplen = gaplen;
+  row->rsize = size;
+  row->render = NULL; //rendered the first time the row is drawn
+  row->rcap = 0;
+  row->tabs = tabs;
+  row->utf8 = -1; //counted the first time the row is drawn
+  row->wide = NULL; //indexed the first time a column is looked up
+  row->widecap = row->widegap = row->widerx = 0;
+  row->version = 0;
+  row->rversion = 0;
+  row->flags = flags;
+  row->hl = NULL; //highlighted the first time it is drawn
+  row->hlcap = 0;
+  row->hlversion = 0;
+  row->hlin = row->hlout = HLS_NORMAL;
+  row->longhl = NULL;
+}
+
+char editorRowCharAt(erow *row, int at) //get the character at a given index, skipping over the gap
+{
+  return at < row->gap ? row->chars[at] : row->chars[at + row->gaplen];
+}
+
+void editorRowOwn(erow *row) //give a row its own copy of its text before it is modified
+{
+  if (!(row->flags & ROW_MAPPED)) return;
+  int cap = row->size + KILO_GAP_MIN;
+  char *chars = slabAlloc(&cap);
+  memcpy(chars, row->chars, row->size);
+  if (row->size) arenaHold(row->chars, -1); //a view of arena text lets go of its block
+  row->chars = chars;
+  row->gap = row->size;
+  row->gaplen = cap - row->size;
+  row->flags &= ~ROW_MAPPED;
+}
+
+void editorRowReserve(erow *row, int len) //make sure the gap can take len more characters
+{
+  editorRowOwn(row);
+  if (row->gaplen >= len) return;
+  int cap = row->size + row->gaplen;
+  int newcap = cap * 2; //grow geometrically so that a run of inserts costs amortized O(1) each
+  if (newcap < row->size + len + KILO_GAP_MIN) newcap = row->size + len + KILO_GAP_MIN;
+  row->chars = slabRealloc(row->chars, cap, &newcap);
+  int tail = row->size - row->gap;
+  memmove(&row->chars[newcap - tail], &row->chars[row->gap + row->gaplen], tail); //keep the text after the gap at the end of the buffer
+  row->gaplen = newcap - row->size;
+}
+
+void editorWideMoveGap(erow *row, int at);
+
+void editorRowMoveGap(erow *row, int at) //move the gap so that it starts at a given index
+{
+  editorRowOwn(row);
+  editorWideMoveGap(row, at);
+  if (at < row->gap) //shift the characters between at and the gap to the right
+    memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+  else if (at > row->gap) //shift the characters between the gap and at to the left
+    memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], at - row->gap);
+  row->gap = at;
+}
+
+char *editorRowFlat(erow *row) //close the gap and return the text as one contiguous string (not '\0' terminated)
+{
+  if (row->gap != row->size) editorRowMoveGap(row, row->size);
+  return row->chars;
+}
+
+void editorRowCopy(erow *row, int at, int len, char *dst) //copy the characters [at, at + len) of a row, without closing the gap
+{
+  int head = row->gap - at; //part of the span that lies before the gap
+  if (head > len) head = len;
+  if (head > 0) memcpy(dst, &row->chars[at], head);
+  else head = 0;
+  if (len > head) memcpy(dst + head, &row->chars[at + head + row->gaplen], len - head);
+}
+
+int editorCountTabs(const char *s, int len) //count the tabs in a string
+{
+  int tabs = 0;
+  const char *end = s + len;
+  while ((s = memchr(s, '\t', end - s)) != NULL)
+  {
+    tabs++;
+    s++;
+  }
+  return tabs;
+}
+
+int editorRowUtf8(erow *row) //number of characters in the row that are not ASCII, counted the first time it is needed
+{
+  if (row->utf8 < 0)
+    row->utf8 = utf8CountLeads(row->chars, row->gap) + utf8CountLeads(&row->chars[row->gap + row->gaplen], row->size - row->gap);
+  return row->utf8;
+}
+
+int editorRowDecode(erow *row, int at, unsigned *cp) //decode the character at index at, returns its length in bytes
+{
+  unsigned char s[4];
+  int n = row->size - at < 4 ? row->size - at : 4, j;
+  for (j = 0; j < n; j++)
+    s[j] = editorRowCharAt(row, at + j);
+  return utf8Decode(s, n, cp);
+}
+
+int editorRowNextChar(erow *row, int at) //index just past the grapheme cluster that starts at index at
+{
+  if (at >= row->size) return row->size;
+  if ((unsigned char)editorRowCharAt(row, at) < 0x80 && (at + 1 == row->size || (unsigned char)editorRowCharAt(row, at + 1) < 0x80))
+    return at + 1; //ASCII followed by ASCII
+  unsigned prev, cp;
+  at += editorRowDecode(row, at, &prev);
+  int regional = uniIsRegional(prev);
+  while (at < row->size)
+  {
+    int n = editorRowDecode(row, at, &cp);
+    if (!uniExtends(prev, cp) && !(regional && uniIsRegional(cp))) break;
+    regional = 0; //a flag is a pair of regional indicators, no more
+    prev = cp;
+    at += n;
+  }
+  return at;
+}
+
+int editorRowCodeStart(erow *row, int at) //start of the UTF-8 sequence that the byte at index at belongs to
+{
+  int start = at;
+  while (start > 0 && at - start < 3 && ((unsigned char)editorRowCharAt(row, start) & 0xC0) == 0x80) start--;
+  return start;
+}
+
+int editorRowPrevChar(erow *row, int at) //start of the grapheme cluster that ends at index at, or that the byte before it is in
+{
+  /**Clusters are only well defined going forward, so this steps back to a character that surely starts a cluster,
+  *then walks forward from it with editorRowNextChar().
+  */
+  if (at <= 0) return 0;
+  if ((unsigned char)editorRowCharAt(row, at - 1) < 0x80) return at - 1;
+  int start = editorRowCodeStart(row, at - 1);
+  unsigned cp, prev;
+  editorRowDecode(row, start, &cp);
+  while (start > 0)
+  {
+    int before = editorRowCodeStart(row, start - 1);
+    editorRowDecode(row, before, &prev);
+    if (!uniExtends(prev, cp) && !(uniIsRegional(prev) && uniIsRegional(cp))) break;
+    start = before;
+    cp = prev;
+  }
+  int next;
+  while ((next = editorRowNextChar(row, start)) < at) start = next;
+  return start;
+}
+
+/**The column index makes the conversions between character indexes and screen columns cost O(log n) instead of a walk
+*along the row. It lists the characters that do not take one column per byte, the tabs and the characters that are not
+*ASCII, and the column each one starts at; between them every byte is one column. Like the text, the list is a gap
+*buffer: the entries before the text gap are stored first by their index, and the ones after it at the end of the list
+*by their distance from the end of the row, so an edit at the gap never has to touch the entries after it and moving the
+*gap moves only the entries it passes over. An edit changes the columns of everything after it, so only the first widerx
+*entries have a known rx; the others are worked out one entry at a time, and only as far as a lookup needs. A row that
+*is all ASCII and has no tabs has no index at all: its columns are its indexes.
+*/
+
+int editorWideCount(erow *row) //number of entries the column index of a row has
+{
+  return row->tabs + editorRowUtf8(row);
+}
+
+rowWide *editorWideEntry(erow *row, int i) //the i-th entry of the column index
+{
+  return i < row->widegap ? &row->wide[i] : &row->wide[row->widecap - editorWideCount(row) + i];
+}
+
+int editorWideAt(erow *row, int i) //index of the character of the i-th entry
+{
+  return i < row->widegap ? row->wide[i].at : row->size - row->wide[row->widecap - editorWideCount(row) + i].at;
+}
+
+int editorIsWide(unsigned char c) //whether a byte starts a character that gets an entry in the column index
+{
+  return c == '\t' || c >= 0xC0;
+}
+
+int editorWideSpan(erow *row, int at, int rx, int *w) //length in bytes of the character at index at, *w its width when it starts at column rx
+{
+  if (editorRowCharAt(row, at) == '\t')
+  {
+    *w = KILO_TAB_STOP - rx % KILO_TAB_STOP;
+    return 1;
+  }
+  unsigned cp;
+  int len = editorRowDecode(row, at, &cp);
+  *w = len == 1 ? 1 : uniWidth(cp);
+  return len;
+}
+
+int editorWideFind(const char *s, int at, int len) //index of the first byte at or after at that gets an entry, len if none does
+{
+#ifdef __SSE2__
+  const __m128i tab = _mm_set1_epi8('\t'), lead = _mm_set1_epi8((char)0xBF), zero = _mm_setzero_si128();
+  for (; at + 16 <= len; at += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + at));
+    __m128i wide = _mm_and_si128(_mm_cmpgt_epi8(v, lead), _mm_cmplt_epi8(v, zero)); //0xC0-0xFF, as signed bytes
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(wide, _mm_cmpeq_epi8(v, tab)));
+    if (mask) return at + __builtin_ctz(mask);
+  }
+#endif
+  for (; at < len; at++)
+    if (editorIsWide(s[at])) return at;
+  return len;
+}
+
+void editorWideBuild(erow *row) //index the tabs and the characters that are not ASCII of a row that has no index yet
+{
+  int count = editorWideCount(row), n = 0, j;
+  int size = sizeof(rowWide) * (count + KILO_GAP_MIN);
+  row->wide = slabAlloc(&size);
+  row->widecap = size / sizeof(rowWide);
+  const char *s = row->chars;
+  for (j = editorWideFind(s, 0, row->gap); j < row->gap; j = editorWideFind(s, j + 1, row->gap)) //the entries before the gap go first
+    row->wide[n++].at = j;
+  row->widegap = n;
+  s += row->gap + row->gaplen; //the ones after it at the end
+  for (j = editorWideFind(s, 0, row->size - row->gap); j < row->size - row->gap; j = editorWideFind(s, j + 1, row->size - row->gap))
+    row->wide[row->widecap - count + n++].at = row->size - row->gap - j;
+  row->widerx = 0;
+}
+
+void editorWideTruncate(erow *row, int tabs, int leads) //the text after the gap, with tabs tabs and leads lead bytes, is cut off
+{
+  row->tabs -= tabs;
+  if (row->utf8 >= 0) row->utf8 -= leads;
+  if (row->wide && row->widerx > row->widegap) row->widerx = row->widegap; //the entries before the gap are all that is left
+}
+
+int editorWideBefore(erow *row, int cx) //number of entries for the characters before index cx
+{
+  int lo = 0, hi = editorWideCount(row);
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (editorWideAt(row, mid) < cx) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+void editorWideMoveGap(erow *row, int at) //the text gap is moving to index at: move the entries it passes to the other side
+{
+  if (!row->wide) return;
+  int back = row->widecap - (editorWideCount(row) - row->widegap); //where the entries after the gap start
+  while (row->widegap > 0 && row->wide[row->widegap - 1].at >= at)
+  {
+    row->wide[--back] = row->wide[--row->widegap];
+    row->wide[back].at = row->size - row->wide[back].at;
+  }
+  while (back < row->widecap && row->size - row->wide[back].at < at)
+  {
+    row->wide[row->widegap] = row->wide[back++];
+    row->wide[row->widegap++].at = row->size - row->wide[back - 1].at;
+  }
+}
+
+void editorWideEdited(erow *row, int at) //the text changed at index at: forget the columns of the entries it can move
+{
+  int keep = editorWideBefore(row, at - 3); //a character up to 3 bytes back may have been completed or cut short
+  if (row->widerx > keep) row->widerx = keep;
+}
+
+void editorWideInsert(erow *row, int at, const char *s, int len) //s goes in at the text gap, which is at index at
+{
+  int tabs = editorCountTabs(s, len), leads = utf8CountLeads(s, len);
+  if (row->wide)
+  {
+    editorWideEdited(row, at);
+    int count = editorWideCount(row);
+    if (count + tabs + leads > row->widecap) //grow, keeping the entries after the gap at the end
+    {
+      int back = count - row->widegap, cap = row->widecap * 2;
+      if (cap < count + tabs + leads + KILO_GAP_MIN) cap = count + tabs + leads + KILO_GAP_MIN;
+      int size = sizeof(rowWide) * cap;
+      row->wide = slabRealloc(row->wide, sizeof(rowWide) * row->widecap, &size);
+      cap = size / sizeof(rowWide);
+      memmove(&row->wide[cap - back], &row->wide[row->widecap - back], sizeof(rowWide) * back);
+      row->widecap = cap;
+    }
+    int j;
+    for (j = 0; j < len && tabs + leads; j++)
+      if (editorIsWide(s[j])) row->wide[row->widegap++].at = at + j;
+  }
+  row->tabs += tabs;
+  if (row->utf8 >= 0) row->utf8 += leads;
+}
+
+void editorWideDelete(erow *row, int at, int len) //the len characters before the text gap, starting at index at, are deleted
+{
+  int tabs = editorCountTabs(&row->chars[at], len), leads = utf8CountLeads(&row->chars[at], len);
+  row->tabs -= tabs;
+  if (row->utf8 >= 0) row->utf8 -= leads;
+  if (!row->wide) return;
+  row->widegap -= tabs + leads;
+  editorWideEdited(row, at);
+}
+
+int editorWideRx(erow *row, int i) //the column the character of the i-th entry starts at
+{
+  while (row->widerx <= i)
+  {
+    int k = row->widerx++, rx;
+    if (k == 0)
+    {
+      rx = editorWideAt(row, 0);
+    }
+    else
+    {
+      int prev = editorWideAt(row, k - 1), prevrx = editorWideEntry(row, k - 1)->rx, w;
+      int len = editorWideSpan(row, prev, prevrx, &w);
+      rx = prevrx + w + (editorWideAt(row, k) - prev - len); //past the previous entry, one column per byte up to this one
+    }
+    editorWideEntry(row, k)->rx = rx;
+  }
+  return editorWideEntry(row, i)->rx;
+}
+
+int editorRowCxToRx(erow *row, int cx)    //converts the index of a character in a row to the screen column it is drawn at
+{
+  if (row->tabs == 0 && editorRowUtf8(row) == 0) return cx; //one column per character
+  if (!row->wide) editorWideBuild(row);
+  int k = editorWideBefore(row, cx);
+  if (k == 0) return cx;
+  int at = editorWideAt(row, k - 1), rx = editorWideRx(row, k - 1), w;
+  int len = editorWideSpan(row, at, rx, &w);
+  if (cx < at + len) return rx; //inside a character: the column it starts at
+  return rx + w + (cx - at - len);
+}
+
+int editorRowRxtoCx(erow *row, int rx)
+{
+  /**To convert a column into a character index, find the last entry of the column index that starts at or before rx.
+  *If rx falls on that character, that is the answer; otherwise rx is on the plain text after it, one column per byte.
+  */
+  if (row->tabs == 0 && editorRowUtf8(row) == 0) return rx < row->size ? rx : row->size;
+  if (!row->wide) editorWideBuild(row);
+  int count = editorWideCount(row);
+  while (row->widerx < count && (row->widerx == 0 || editorWideEntry(row, row->widerx - 1)->rx <= rx))
+    editorWideRx(row, row->widerx);
+  int lo = 0, hi = row->widerx;
+  while (lo < hi) //the first entry that starts past rx
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (editorWideEntry(row, mid)->rx <= rx) lo = mid + 1;
+    else hi = mid;
+  }
+  int cx = rx;
+  if (lo > 0)
+  {
+    int at = editorWideAt(row, lo - 1), start = editorWideEntry(row, lo - 1)->rx, w;
+    int len = editorWideSpan(row, at, start, &w);
+    cx = rx < start + w ? at : at + len + (rx - start - w);
+  }
+  return cx < row->size ? cx : row->size;
+}
+
+void editorUpdateRow(erow *row)           //the text of a row changed: its render field is rebuilt the next time it is needed
+{
+  row->version++;
+  E.changes++;
+}
+
+void editorRowRenderReserve(erow *row, int len) //make sure the render buffer can hold len characters
+{
+  if (row->rcap >= len) return;
+  int cap = len * 2 > KILO_SLAB_MIN ? len * 2 : KILO_SLAB_MIN;
+  row->render = slabRealloc(row->render, row->rcap, &cap);
+  row->rcap = cap;
+}
+
+char *editorRowRender(erow *row)           //converts each tab character in a row to spaces, so that when we draw the row to the screen, the tabs will be displayed correctly.
+{
+  if (row->tabs == 0) //nothing to expand: the render field is the text itself
+  {
+    slabFree(row->render, row->rcap);
+    row->render = NULL;
+    row->rcap = 0;
+    row->rsize = row->size;
+    return editorRowFlat(row);
+  }
+  if (row->rversion == row->version && row->render) return row->render; //still up to date
+
+  editorRowRenderReserve(row, row->size + row->tabs*(KILO_TAB_STOP - 1));
+
+  int j;
+  int idx = 0;
+  for (j = 0; j < row->size; j++) //loop through the chars of the row again, and this time copy the chars to render, replacing tabs with spaces
+  {
+    char c = editorRowCharAt(row, j);
+    if (c == '\t') {
+      row->render[idx++] = ' ';
+      while (idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+    } else {
+      row->render[idx++] = c;
+    }
+  }
+  row->rsize = idx;
+  row->rversion = row->version;
+  return row->render;
+}
+
+int editorRowNextTab(erow *row, int at) //index of the first tab at or after a given index, -1 if there is none
+{
+  if (row->tabs == 0) return -1;
+  if (!row->wide) editorWideBuild(row);
+  int k, count = editorWideCount(row);
+  for (k = editorWideBefore(row, at); k < count; k++)
+    if (editorRowCharAt(row, editorWideAt(row, k)) == '\t') return editorWideAt(row, k);
+  return -1;
+}
+
+int editorRenderPatchInsert(erow *row, int at, int c) //patch a valid render field for a character about to be inserted at 'at'
+{
+  /**Returns 1 when render is valid again once the character is in.
+  *A character inserted before a tab pushes the text up to that tab one column right, and the tab absorbs the shift by
+  *getting one column narrower, so only the span up to the tab changes. Only when that tab was a single column wide does
+  *the rest of the line move, and then the render is simply rebuilt.
+  */
+  if (c == '\t' || (unsigned char)c >= 0x80) return 0;
+  if (row->tabs == 0) return 1;
+  if (editorRowUtf8(row) || !row->render || row->rversion != row->version) return 0; //the render of a row that is not ASCII is not used
+
+  int rx = editorRowCxToRx(row, at);
+  int tab = editorRowNextTab(row, at);
+  if (tab == -1) //no tab after the insertion point: the tail of the render moves one column
+  {
+    editorRowRenderReserve(row, row->rsize + 1);
+    memmove(&row->render[rx + 1], &row->render[rx], row->rsize - rx);
+    row->rsize++;
+  }
+  else
+  {
+    int tabrx = rx + (tab - at);
+    if (KILO_TAB_STOP - tabrx % KILO_TAB_STOP == 1) return 0;
+    memmove(&row->render[rx + 1], &row->render[rx], tabrx - rx); //the tab loses its first column
+  }
+  row->render[rx] = c;
+  return 1;
+}
+
+int editorRenderPatchDelete(erow *row, int at) //patch a valid render field for the character about to be deleted at 'at'
+{
+  /**Returns 1 when render is valid again once the character is gone. The mirror image of editorRenderPatchInsert:
+  *the following tab grows by one column, unless it was already a full tab stop wide.
+  */
+  if (row->tabs == 0) return 1;
+  if (editorRowCharAt(row, at) == '\t' || editorRowUtf8(row) || !row->render || row->rversion != row->version) return 0;
+
+  int rx = editorRowCxToRx(row, at);
+  int tab = editorRowNextTab(row, at + 1);
+  if (tab == -1) //no tab after the deleted character: the tail of the render moves one column back
+  {
+    memmove(&row->render[rx], &row->render[rx + 1], row->rsize - rx - 1);
+    row->rsize--;
+  }
+  else
+  {
+    int tabrx = rx + (tab - at);
+    if (KILO_TAB_STOP - tabrx % KILO_TAB_STOP == KILO_TAB_STOP) return 0;
+    memmove(&row->render[rx], &row->render[rx + 1], tabrx - rx - 1);
+    row->render[tabrx - 1] = ' '; //the tab gains a column
+  }
+  return 1;
+}
+
+void editorInsertRow(int at, char *s, size_t len) //insert a row at a given index
+{
+  if(at < 0 || at > E.numrows) return;
+
+  erow row;
+  int cap = len + KILO_GAP_MIN;
+  char *chars = slabAlloc(&cap);
+  memcpy(chars, s, len);
+  editorRowInit(&row, chars, len, cap - len, editorCountTabs(s, len), 0); //not rendered until it is drawn
+  ropeInsert(at, &row); //the rope only moves rows inside one leaf, never the whole file
+  editorRowsChanged(at);
+  E.changes++;
+
+  E.numrows++; //increment the number of rows in the editor
+  E.dirty++; //increment the dirty flag, to indicate that the file has been modified
+}
+
+int editorInsertRows(int at, const char *s, size_t len, int strip) //insert the lines of s as rows at a given index, returns the number of rows
+{
+  /**s is split at every '\n', so a text with n newlines makes n + 1 rows. The text is copied into an arena block in one
+  *go and the rows are views into it. The lines are found by the line scanner and packed into full new leaves, which join
+  *the rope with one split and two merges instead of one rope insert per row. With strip set the \r's that end the lines
+  *are left out of the rows, as they are when a file with \r\n line endings is read.
+  */
+  if (at < 0 || at > E.numrows) return 0;
+
+  char *text = arenaAlloc(len);
+  memcpy(text, s, len);
+  lineScan scan = {NULL, NULL, 1, 0, 0, 0};
+  editorScanLines(text, len, &scan);
+  if (len == 0 || s[len - 1] == '\n') scanAddLine(&scan, len, 0); //the text after the last newline is a row too, even when empty
+  ropeInsertRope(at, ropeBuild(text, &scan, strip));
+
+  int n = scan.n;
+  free(scan.end);
+  free(scan.tabs);
+  E.numrows += n;
+  E.dirty++;
+  editorRowsChanged(at);
+  E.changes++;
+  return n;
+}
+
+void editorFreeRow(erow *row) //free the memory used by a row
+{
+  slabFree(row->render, row->rcap);
+  slabFree(row->hl, row->hlcap);
+  slabFree(row->wide, sizeof(rowWide) * row->widecap);
+  editorLongFree(row);
+  if (!(row->flags & ROW_MAPPED)) slabFree(row->chars, row->size + row->gaplen);
+  else if (row->size) arenaHold(row->chars, -1);
+}
+
+void editorDelRow(int at) //delete a row at a given index
+{
+  if(at < 0 || at >= E.numrows) return; 
+  editorFreeRow(editorRow(at));
+  ropeDelete(at);
+  editorRowsChanged(at);
+  E.changes++;
+  E.numrows--;
+  E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) //insert a character into a row at a given index 
+{
+  if(at < 0 || at >row->size) at = row->size; //if at is negative, set it to the end of the row. If it is greater than the size of the row, set it to the end of the row.
+  int patched = editorRenderPatchInsert(row, at, c); //patch the render field while the old text is still there
+  editorRowReserve(row, 1); //make room for one more character
+  editorRowMoveGap(row, at); //move the gap to the insertion point, only the characters in between are shifted
+  char ch = c;
+  editorWideInsert(row, at, &ch, 1);
+  row->chars[row->gap++] = c; //insert the character at the start of the gap
+  row->gaplen--;
+  row->size++;
+  editorSyntaxEdited(row, at, 0, 1);
+  editorUpdateRow(row); //update the render field of the row to reflect the change
+  if (patched) row->rversion = row->version;
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Editor Operations ******************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+void editorInsertChar(int c) //insert a character at the cursor position
+{
+  char ch = c;
+  undoRecord(UNDO_INSERT, E.cy, E.cx, &ch, 1, E.cy == E.numrows ? UNDO_NEWROW : 0);
+  if(E.cy == E.numrows) //if the cursor is on the last row, append a new row to the end of the file
+  {
+    editorInsertRow(E.numrows,"", 0); //append a new row to the end of the file
+  }
+  editorRowsChanged(E.cy);
+  editorRowInsertChar(editorRow(E.cy), E.cx, c); //insert the character at the cursor position
+  E.cx++; //move the cursor to the right
+  E.dirty++; //increment the dirty flag, to indicate that the file has been modified
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) //insert a string into a row at a given index
+{
+  editorRowReserve(row, len);
+  editorRowMoveGap(row, at);
+  editorWideInsert(row, at, s, len);
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->gaplen -= len;
+  row->size += len;
+  editorSyntaxEdited(row, at, 0, len);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) //append a string to the end of a row
+{
+  editorRowInsertString(row, row->size, s, len);
+}
+
+void editorRowDelChars(erow *row, int at, int len) //delete len characters from a row, starting at a given index
+{
+  editorRowMoveGap(row, at + len); //the characters now lie right before the gap, which widens over them
+  editorWideDelete(row, at, len);
+  row->gap -= len;
+  row->gaplen += len;
+  row->size -= len;
+  editorSyntaxEdited(row, at, len, 0);
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+/*
+*editorInsertChar() doesn’t have to worry about the details of modifying an erow, and editorRowInsertChar() doesn’t have to worry about where the cursor is. 
+*That is the difference between functions in the  editor operations  section and functions in the row operations section.
+*/
+void editorRowDelChar(erow *row, int at) //delete a character from a row
+{
+  if(at < 0 || at >= row->size) return; //If the cursor’s past the end of the file, then there is nothing to delete, and we return immediately
+  int patched = editorRenderPatchDelete(row, at);
+  editorRowMoveGap(row, at + 1); //move the gap right after the character, then widen the gap over it
+  editorWideDelete(row, at, 1);
+  row->gap--;
+  row->gaplen++;
+  row->size--; //decrement the size of the row
+  editorSyntaxEdited(row, at, 1, 0);
+  editorUpdateRow(row); //update the render field of the row to reflect the change
+  if (patched) row->rversion = row->version;
+  
+  E.dirty++; //increment the dirty flag, to indicate that the file has been modified
+}
+
+void editorInsertNewline() //insert a newline at the cursor position
+{
+  if (E.cy == E.numrows) undoRecord(UNDO_INSERT, E.cy, 0, "", 0, UNDO_NEWROW); //past the end, a newline only adds a row
+  else undoRecord(UNDO_INSERT, E.cy, E.cx, "\n", 1, 0);
+  editorRowsChanged(E.cy);
+  if(E.cx == 0)
+  {
+    editorInsertRow(E.cy, "", 0);
+  }
+  else
+  {
+    erow *row = editorRow(E.cy);
+    editorRowMoveGap(row, E.cx); //the text after the cursor is now one contiguous run after the gap
+    editorInsertRow(E.cy + 1, &row->chars[row->gap + row->gaplen], row->size - E.cx);
+    row = editorRow(E.cy);
+    int moved = row->size - E.cx;
+    editorWideTruncate(row, editorRow(E.cy + 1)->tabs, utf8CountLeads(&row->chars[row->gap + row->gaplen], moved));
+    row->gaplen += moved; //the gap swallows the text that moved to the new row
+    row->size = E.cx;
+    editorSyntaxEdited(row, E.cx, moved, 0);
+    editorUpdateRow(row);
+  }
+  E.cy++;
+  E.cx = 0;
 }
 
 void editorDelChar() //delete a character at the cursor position
 {
-  if(E.cy == E.numrows) return; //if the cursor is past the end of the file, then there is nothing to delete, and we return immediately
-  
-  if(E.cx == 0 && E.cy == 0) return; // If the cursor is at the beginning of the file (top-left corner), return immediately.
+  if(E.cy == E.numrows) return; //if the cursor is past the end of the file, then there is nothing to delete, and we return immediately
+  
+  if(E.cx == 0 && E.cy == 0) return; // If the cursor is at the beginning of the file (top-left corner), return immediately.
+
+  erow *row = editorRow(E.cy); //get the row that the cursor is on
+  
+  if(E.cx > 0)
+  {
+    int from = editorRowPrevChar(row, E.cx); //a whole grapheme cluster goes, however many bytes it takes
+    editorRowMoveGap(row, E.cx); //the cluster now lies right before the gap
+    undoRecord(UNDO_DELETE, E.cy, from, &row->chars[from], E.cx - from, 0);
+    editorRowsChanged(E.cy);
+    if (E.cx - from == 1) editorRowDelChar(row, from);
+    else editorRowDelChars(row, from, E.cx - from);
+    E.cx = from; //move the cursor to the left
+  }
+  else
+  {
+    erow *prev = editorRow(E.cy - 1);
+    undoRecord(UNDO_DELETE, E.cy - 1, prev->size, "\n", 1, 0); //joining two rows deletes the newline between them
+    editorRowsChanged(E.cy - 1);
+    E.cx = prev->size;
+    editorRowAppendString(prev, editorRowFlat(row), row->size);
+    editorDelRow(E.cy);
+    E.cy--;    
+  } 
+}
+
+/**editorInsertText() and editorDeleteText() edit any amount of text, which may span rows, in one go; they are what undo
+*and redo replay edits with. Rows are only split or joined at the two ends, and the rows in between are inserted or
+*deleted one by one, so the work is in proportion to the text edited.
+*/
+
+char *editorTextRange(int at, int col, int endrow, int endcol, int *len) //copy the text between two positions, rows joined by '\n'
+{
+  struct abuf ab = ABUF_INIT;
+  for (; at <= endrow; at++, col = 0)
+  {
+    erow *row = editorRow(at);
+    int end = at == endrow ? endcol : row->size;
+    abAppend(&ab, editorRowFlat(row) + col, end - col);
+    if (at < endrow) abAppend(&ab, "\n", 1);
+  }
+  *len = ab.len;
+  return ab.b;
+}
+
+void editorInsertText(int at, int col, const char *s, int len) //insert text that may hold newlines at a position
+{
+  undoRecord(UNDO_INSERT, at, col, s, len, at == E.numrows ? UNDO_NEWROW : 0);
+  if (at == E.numrows) editorInsertRow(at, "", 0);
+  editorRowsChanged(at);
+
+  const char *nl = memchr(s, '\n', len), *end = s + len;
+  erow *row = editorRow(at);
+  if (!nl)
+  {
+    editorRowInsertString(row, col, s, len);
+    return;
+  }
+
+  editorRowMoveGap(row, col); //cut off the text after col, it goes at the end of the last new row
+  int taillen = row->size - col;
+  char *tail = xmalloc(taillen + 1);
+  memcpy(tail, &row->chars[row->gap + row->gaplen], taillen);
+  editorRowDelChars(row, col, taillen);
+  editorRowInsertString(row, col, s, nl - s);
+
+  at += editorInsertRows(at + 1, nl + 1, end - nl - 1, 0); //the rest of the lines go in as new rows in one go
+  row = editorRow(at);
+  editorRowInsertString(row, row->size, tail, taillen);
+  free(tail);
+}
+
+void editorDeleteText(int at, int col, int endrow, int endcol) //delete the text between two positions
+{
+  if (!E.undo.replaying)
+  {
+    int len;
+    char *text = editorTextRange(at, col, endrow, endcol, &len);
+    undoRecord(UNDO_DELETE, at, col, text, len, 0);
+    free(text);
+  }
+  editorRowsChanged(at);
+
+  erow *row = editorRow(at);
+  if (at == endrow)
+  {
+    editorRowDelChars(row, col, endcol - col);
+    return;
+  }
+  erow *last = editorRow(endrow); //join what is left of the first and the last row
+  editorRowDelChars(row, col, row->size - col);
+  editorRowInsertString(row, col, editorRowFlat(last) + endcol, last->size - endcol);
+  while (endrow-- > at)
+    editorDelRow(at + 1);
+}
+
+void editorPaste() //insert the text of a bracketed paste at the cursor as one edit, and move the cursor past it
+{
+  char *b = E.input.paste.b + E.input.pastefrom;
+  int len = E.input.pasteto - E.input.pastefrom;
+  if (len == 0) return;
+  char *cr = memchr(b, '\r', len);
+  if (cr) //terminals send line breaks as \r: turn \r\n and lone \r into \n
+  {
+    int j, n = cr - b;
+    for (j = n; j < len; j++)
+    {
+      if (b[j] != '\r') b[n++] = b[j];
+      else
+      {
+        b[n++] = '\n';
+        if (j + 1 < len && b[j + 1] == '\n') j++;
+      }
+    }
+    len = n;
+  }
+
+  editorInsertText(E.cy, E.cx, b, len);
+  char *last = memrchr(b, '\n', len);
+  if (!last)
+  {
+    E.cx += len;
+    return;
+  }
+  int j;
+  for (j = 0; j < len; j++)
+    if (b[j] == '\n') E.cy++;
+  E.cx = b + len - last - 1;
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Undo *******************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**Every edit is logged as the text it inserted or deleted at a position, which is all it takes to undo or redo it:
+*the position and the text give the range to delete or the text to put back, so the cost of undoing an edit grows with
+*the size of the edit, never with the size of the file. The entries are carved one after another from a single buffer,
+*like an arena, and each ends with its own size so the log can be walked backwards. Keystrokes that continue the last
+*entry (typing on, backspacing, deleting forwards) are merged into it, so a run of typing is undone as a whole.
+*When the log outgrows its limit, the oldest entries are dropped.
+*/
+
+undoEntry *undoAt(int off) //the entry that starts at a byte offset of the log
+{
+  return (undoEntry *)(E.undo.buf + off);
+}
+
+char *undoText(undoEntry *e) //the text of an entry, which follows its header
+{
+  return (char *)(e + 1);
+}
+
+int undoSize(int len) //bytes taken by an entry with len bytes of text, padded so that the next header is aligned
+{
+  return (sizeof(undoEntry) + len + sizeof(int) + 3) & ~3;
+}
+
+void undoSeal(undoEntry *e) //update the size of an entry, at its head and its tail
+{
+  e->size = undoSize(e->len);
+  memcpy((char *)e + e->size - sizeof(int), &e->size, sizeof(int));
+}
+
+undoEntry *undoLast() //the entry that was applied last, NULL when there is nothing to undo
+{
+  int size;
+  if (E.undo.pos == 0) return NULL;
+  memcpy(&size, E.undo.buf + E.undo.pos - sizeof(int), sizeof(int));
+  return undoAt(E.undo.pos - size);
+}
+
+int undoState() //names the state of the file: the id of the last entry applied
+{
+  undoEntry *e = undoLast();
+  return e ? e->id : E.undo.baseid;
+}
+
+undoEntry *undoReserve(int off, int len) //make room for an entry of len bytes of text at off, the new end of the log
+{
+  int size = undoSize(len);
+  if (off + size > E.undo.cap)
+  {
+    E.undo.cap = E.undo.cap ? E.undo.cap * 2 : 4096;
+    if (E.undo.cap < off + size) E.undo.cap = off + size;
+    E.undo.buf = xrealloc(E.undo.buf, E.undo.cap);
+  }
+  E.undo.len = E.undo.pos = off + size;
+  return undoAt(off);
+}
+
+void undoTrim() //drop the oldest entries once the log is over its limit
+{
+  if (E.undo.len <= E.undo.limit) return;
+  int off = 0;
+  while (off < E.undo.pos && E.undo.len - off > E.undo.limit / 2) //down to half the limit, so trimming is rare
+  {
+    undoEntry *e = undoAt(off);
+    E.undo.baseid = e->id;
+    off += e->size;
+  }
+  memmove(E.undo.buf, E.undo.buf + off, E.undo.len - off);
+  E.undo.len -= off;
+  E.undo.pos -= off;
+}
+
+void undoRecord(int op, int row, int col, const char *s, int len, int flags) //log an edit that is about to be made
+{
+  if (E.undo.replaying) return;
+  journalEdit(op, row, col, s, len, flags);
+
+  undoEntry *e = undoLast();
+  if (e && E.undo.pos == E.undo.len && e->op == op && e->row == row && e->id != E.undo.savedid &&
+      e->len < KILO_UNDO_RUN_MAX && !memchr(s, '\n', len) && !memchr(undoText(e), '\n', e->len))
+  {
+    int off = (char *)e - E.undo.buf;
+    if (op == UNDO_INSERT && col == e->col + e->len) //typing on
+    {
+      e = undoReserve(off, e->len + len);
+      memcpy(undoText(e) + e->len, s, len);
+      e->len += len;
+      undoSeal(e);
+      return;
+    }
+    if (op == UNDO_DELETE && (col + len == e->col || col == e->col)) //backspacing, or deleting forwards
+    {
+      e = undoReserve(off, e->len + len);
+      if (col == e->col)
+      {
+        memcpy(undoText(e) + e->len, s, len);
+      }
+      else
+      {
+        memmove(undoText(e) + len, undoText(e), e->len);
+        memcpy(undoText(e), s, len);
+        e->col = col;
+      }
+      e->len += len;
+      undoSeal(e);
+      return;
+    }
+  }
+
+  e = undoReserve(E.undo.pos, len); //a new entry, which replaces whatever could have been redone
+  e->op = op;
+  e->flags = flags;
+  e->row = row;
+  e->col = col;
+  e->len = len;
+  e->cx = E.cx;
+  e->cy = E.cy;
+  e->id = ++E.undo.nextid;
+  if (len) memcpy(undoText(e), s, len);
+  undoSeal(e);
+  undoTrim();
+}
+
+void editorTextEnd(int at, int col, const char *s, int len, int *row, int *endcol) //where text put at a position ends
+{
+  int j, nl = -1;
+  *row = at;
+  for (j = 0; j < len; j++)
+    if (s[j] == '\n')
+    {
+      (*row)++;
+      nl = j;
+    }
+  *endcol = nl == -1 ? col + len : len - nl - 1;
+}
+
+void undoEnd(undoEntry *e, int *row, int *col) //where the text of an entry ends once it is in the file
+{
+  editorTextEnd(e->row, e->col, undoText(e), e->len, row, col);
+}
+
+void editorUndo() //take back the last edit
+{
+  undoEntry *e = undoLast();
+  if (!e)
+  {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  int row, col;
+  undoEnd(e, &row, &col);
+  journalEdit(e->op == UNDO_INSERT ? UNDO_DELETE : UNDO_INSERT, e->row, e->col, undoText(e), e->len, e->flags);
+  E.undo.replaying = 1;
+  if (e->op == UNDO_INSERT)
+  {
+    editorDeleteText(e->row, e->col, row, col);
+    if (e->flags & UNDO_NEWROW) editorDelRow(e->row);
+  }
+  else
+  {
+    editorInsertText(e->row, e->col, undoText(e), e->len);
+  }
+  E.undo.replaying = 0;
+  E.cx = e->cx;
+  E.cy = e->cy;
+  E.undo.pos -= e->size;
+  E.dirty = undoState() == E.undo.savedid ? 0 : E.dirty + 1; //back at the saved text, the file is clean again
+}
+
+void editorRedo() //make the last edit that was taken back again
+{
+  if (E.undo.pos == E.undo.len)
+  {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  undoEntry *e = undoAt(E.undo.pos);
+  int row, col;
+  undoEnd(e, &row, &col);
+  journalEdit(e->op, e->row, e->col, undoText(e), e->len, e->flags);
+  E.undo.replaying = 1;
+  if (e->op == UNDO_INSERT)
+  {
+    editorInsertText(e->row, e->col, undoText(e), e->len);
+    E.cy = row;
+    E.cx = col;
+  }
+  else
+  {
+    editorDeleteText(e->row, e->col, row, col);
+    E.cy = e->row;
+    E.cx = e->col;
+  }
+  E.undo.replaying = 0;
+  E.undo.pos += e->size;
+  E.dirty = undoState() == E.undo.savedid ? 0 : E.dirty + 1;
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Journal ****************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**Every edit that goes into the undo log, and every undo and redo, is also appended to a journal next to the file, so
+*that a crash or a dropped connection does not lose the edits that were not saved. The main thread never waits on the
+*disk: it packs each edit into a record and copies it into a ring, which it alone moves the head of, and a writer thread
+*moves the tail as it writes the records out, calling fsync() at most every KILO_JOURNAL_SYNC ms. If the writer falls
+*behind and the ring fills up, records wait in a buffer of the main thread until there is room. A journal starts with the
+*size and modification time of the file its edits apply to. Saving cuts it back to nothing and quitting removes it, so a
+*journal found when a file is opened holds the edits of a session that did not end. If it belongs to the file as it is
+*on disk, it is replayed with editorInsertText() and editorDeleteText() up to the first record that was cut short or does
+*not fit the text, and journaling goes on after that record.
+*/
+
+unsigned journalSum(unsigned h, const void *p, size_t len) //FNV-1a of len bytes, going on from h
+{
+  const unsigned char *s = p;
+  while (len--)
+    h = (h ^ *s++) * 16777619u;
+  return h;
+}
+
+unsigned journalEntrySum(journalEntry *r, const char *s) //checksum of a record and its text
+{
+  unsigned sum = r->sum, h;
+  r->sum = 0;
+  h = journalSum(journalSum(2166136261u, r, sizeof(*r)), s, r->len);
+  r->sum = sum;
+  return h;
+}
+
+void journalBase(journalHeader *h) //describe the file on disk, which the edits journaled from now on apply to
+{
+  struct stat st;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, KILO_JOURNAL_MAGIC, sizeof(h->magic));
+  h->size = -1;
+  if (stat(E.filename, &st) == 0)
+  {
+    h->size = st.st_size;
+    h->mtime = st.st_mtim.tv_sec;
+    h->mtimensec = st.st_mtim.tv_nsec;
+  }
+}
+
+int journalPush(const char *s, int len) //copy as much of s into the ring as there is room for, returns how much that was
+{
+  struct editorJournal *j = &E.journal;
+  unsigned long long room = KILO_JOURNAL_RING - (j->head - __atomic_load_n(&j->tail, __ATOMIC_SEQ_CST));
+  int n = (unsigned long long)len < room ? len : (int)room;
+  int at = j->head % KILO_JOURNAL_RING;
+  int first = n < KILO_JOURNAL_RING - at ? n : KILO_JOURNAL_RING - at;
+  memcpy(j->ring + at, s, first);
+  memcpy(j->ring, s + first, n - first); //the rest wraps around to the start
+  __atomic_store_n(&j->head, j->head + n, __ATOMIC_RELEASE); //the bytes are in place before the writer can see them
+  return n;
+}
+
+void journalQueue(const char *s, int len) //queue bytes for the writer thread, behind the ones already waiting
+{
+  struct editorJournal *j = &E.journal;
+  j->queued += len;
+  if (j->over.len == j->overoff)
+  {
+    int n = journalPush(s, len);
+    s += n;
+    len -= n;
+  }
+  if (len > 0) abAppend(&j->over, s, len); //the ring is full, journalPump() moves them in later
+}
+
+void journalEdit(int op, int row, int col, const char *s, int len, int flags) //journal an edit that is about to be made
+{
+  struct editorJournal *j = &E.journal;
+  if (!j->on) return;
+  if (!j->based) //the first edit since the file was opened or saved says which file the edits apply to
+  {
+    journalQueue((char *)&j->base, sizeof(j->base));
+    j->based = 1;
+  }
+  journalEntry r;
+  memset(&r, 0, sizeof(r));
+  r.size = sizeof(r) + len;
+  r.op = op;
+  r.flags = flags;
+  r.row = row;
+  r.col = col;
+  r.len = len;
+  r.sum = journalEntrySum(&r, s);
+  journalQueue((char *)&r, sizeof(r));
+  journalQueue(s, len);
+}
+
+void journalPump() //move waiting records into the ring and wake the writer thread for what was queued, once a frame
+{
+  struct editorJournal *j = &E.journal;
+  if (!j->on) return;
+  if (j->over.len > j->overoff)
+  {
+    __atomic_store_n(&j->waiting, 1, __ATOMIC_SEQ_CST); //set before the tail is read, the writer reads it after moving the tail
+    j->overoff += journalPush(j->over.b + j->overoff, j->over.len - j->overoff);
+    if (j->overoff == j->over.len)
+    {
+      j->over.len = j->overoff = 0;
+      __atomic_store_n(&j->waiting, 0, __ATOMIC_RELAXED);
+    }
+  }
+  if (j->head != j->notified)
+  {
+    write(j->notify[1], "", 1); //when the pipe is full a wakeup is already pending
+    j->notified = j->head;
+  }
+  int failed = __atomic_exchange_n(&j->failed, 0, __ATOMIC_RELAXED);
+  if (failed) editorSetStatusMessage("Can't write the journal! %s", strerror(failed));
+}
+
+void journalWrite(unsigned long long from, unsigned long long to) //write out the bytes of the ring between two positions
+{
+  struct editorJournal *j = &E.journal;
+  while (from < to)
+  {
+    int at = from % KILO_JOURNAL_RING;
+    size_t n = to - from < (unsigned long long)(KILO_JOURNAL_RING - at) ? to - from : (size_t)(KILO_JOURNAL_RING - at);
+    ssize_t w = write(j->fd, j->ring + at, n);
+    if (w == -1)
+    {
+      if (errno == EINTR) continue;
+      __atomic_store_n(&j->failed, errno, __ATOMIC_RELAXED); //the records are dropped, there is no disk to wait for
+      return;
+    }
+    from += w;
+  }
+}
+
+void *journalWriter(void *arg) //the writer thread: writes out what the main thread queues, and syncs it now and then
+{
+  struct editorJournal *j = &E.journal;
+  unsigned long long tail = j->tail, cutdone = __atomic_load_n(&j->cut, __ATOMIC_ACQUIRE);
+  long synced = 0;
+  int unsynced = 0;
+  (void)arg;
+  while (1)
+  {
+    unsigned long long head = __atomic_load_n(&j->head, __ATOMIC_ACQUIRE);
+    unsigned long long cut = __atomic_load_n(&j->cut, __ATOMIC_ACQUIRE);
+    if (cut != cutdone && cut - 1 == tail) //everything queued before the save is out: start the file over
+    {
+      if (ftruncate(j->fd, 0) == -1) __atomic_store_n(&j->failed, errno, __ATOMIC_RELAXED);
+      cutdone = cut;
+      unsynced = 1;
+      continue;
+    }
+    if (cut != cutdone && cut - 1 < head) head = cut - 1; //stop at the save
+    if (head != tail)
+    {
+      journalWrite(tail, head);
+      tail = head;
+      __atomic_store_n(&j->tail, tail, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&j->waiting, __ATOMIC_SEQ_CST)) editorWake(); //records are waiting for the room just made
+      unsynced = 1;
+      continue;
+    }
+    if (__atomic_load_n(&j->stop, __ATOMIC_ACQUIRE)) break;
+
+    int wait = -1;
+    if (unsynced)
+    {
+      wait = synced + KILO_JOURNAL_SYNC - editorMillis();
+      if (wait <= 0)
+      {
+        fsync(j->fd);
+        synced = editorMillis();
+        unsynced = 0;
+        continue;
+      }
+    }
+    struct pollfd pfd;
+    pfd.fd = j->notify[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, wait) > 0)
+    {
+      char drain[64];
+      while (read(j->notify[0], drain, sizeof(drain)) > 0);
+    }
+  }
+  if (unsynced) fsync(j->fd);
+  return NULL;
+}
+
+int journalApply(journalEntry *r, const char *s) //replay a record of the journal, returns 0 if it does not fit the text
+{
+  if (r->row < 0 || r->row > E.numrows || r->col < 0) return 0;
+  if (r->op == UNDO_INSERT)
+  {
+    if (r->row == E.numrows ? r->col != 0 : r->col > editorRow(r->row)->size) return 0;
+    editorInsertText(r->row, r->col, s, r->len);
+    editorTextEnd(r->row, r->col, s, r->len, &E.cy, &E.cx);
+    return 1;
+  }
+  if (r->op != UNDO_DELETE || r->row == E.numrows) return 0;
+
+  int row, col, len;
+  editorTextEnd(r->row, r->col, s, r->len, &row, &col);
+  if (row >= E.numrows || r->col > editorRow(r->row)->size || col > editorRow(row)->size) return 0;
+  char *text = editorTextRange(r->row, r->col, row, col, &len);
+  int same = len == r->len && memcmp(text, s, len) == 0; //the text to delete must be what was deleted
+  free(text);
+  if (!same) return 0;
+  editorDeleteText(r->row, r->col, row, col);
+  if (r->flags & UNDO_NEWROW) editorDelRow(r->row);
+  E.cy = r->row;
+  E.cx = r->col;
+  return 1;
+}
+
+long journalRecover(int fd, size_t len, int *edits) //replay a journal, returns where its last good record ends or -1 if it is not for this file
+{
+  char *buf = xmalloc(len);
+  size_t off = 0;
+  while (off < len)
+  {
+    ssize_t n = pread(fd, buf + off, len - off, off);
+    if (n <= 0) break;
+    off += n;
+  }
+  journalHeader base;
+  if (off < sizeof(base) || memcmp(buf, E.journal.base.magic, sizeof(base.magic)) != 0)
+  {
+    free(buf);
+    return -1;
+  }
+  memcpy(&base, buf, sizeof(base));
+  if (base.size != E.journal.base.size || base.mtime != E.journal.base.mtime || base.mtimensec != E.journal.base.mtimensec)
+  {
+    free(buf);
+    return -1;
+  }
+
+  len = off;
+  off = sizeof(base);
+  *edits = 0;
+  while (len - off >= sizeof(journalEntry))
+  {
+    journalEntry r;
+    memcpy(&r, buf + off, sizeof(r));
+    if (r.len < 0 || r.size != sizeof(r) + r.len || r.size > len - off) break; //cut short
+    char *s = buf + off + sizeof(r);
+    if (journalEntrySum(&r, s) != r.sum || !journalApply(&r, s)) break;
+    off += r.size;
+    (*edits)++;
+  }
+  free(buf);
+  return off;
+}
+
+void journalCut() //the file was saved with every edit journaled so far, so the journal starts over from the file as it is now
+{
+  struct editorJournal *j = &E.journal;
+  if (!j->on) return;
+  journalBase(&j->base);
+  j->based = 0;
+  __atomic_store_n(&j->cut, j->queued + 1, __ATOMIC_RELEASE);
+  write(j->notify[1], "", 1);
+}
+
+void journalClose() //on exit: the writer thread writes out what is left, and the journal is removed if the user quit
+{
+  struct editorJournal *j = &E.journal;
+  if (!j->on) return;
+  while (!j->discard && j->over.len > j->overoff) //the writer makes room as it goes
+  {
+    journalPump();
+    if (j->over.len > j->overoff) poll(NULL, 0, 1);
+  }
+  journalPump();
+  __atomic_store_n(&j->stop, 1, __ATOMIC_RELEASE);
+  write(j->notify[1], "", 1);
+  pthread_join(j->thread, NULL);
+  if (j->discard) unlink(j->path);
+  close(j->fd);
+  j->on = 0;
+}
+
+void journalOpen(int recover) //start journaling the edits of E.filename, replaying the journal it has if recover is set
+{
+  struct editorJournal *j = &E.journal;
+  if (j->on || !E.filename || E.follow.on) return; //a followed file grows under the journal, which could not be replayed on it later
+  const char *name = strrchr(E.filename, '/');
+  int dirlen = name ? name - E.filename + 1 : 0;
+  name = name ? name + 1 : E.filename;
+  free(j->path);
+  j->path = xmalloc(dirlen + strlen(name) + sizeof(KILO_JOURNAL_SUFFIX) + 1);
+  sprintf(j->path, "%.*s.%s%s", dirlen, E.filename, name, KILO_JOURNAL_SUFFIX);
+  journalBase(&j->base);
+  j->based = 0;
+
+  j->fd = open(j->path, O_RDWR | O_CREAT | O_APPEND, 0600);
+  if (j->fd == -1)
+  {
+    editorSetStatusMessage("Can't open the journal, edits are not journaled: %s", strerror(errno));
+    return;
+  }
+  if (flock(j->fd, LOCK_EX | LOCK_NB) == -1) //its journal is held by another kilo, which is editing the file too
+  {
+    editorSetStatusMessage("%s is open in another kilo, edits are not journaled", E.filename);
+    close(j->fd);
+    return;
+  }
+
+  struct stat st;
+  long keep = 0;
+  int edits = 0;
+  if (recover && fstat(j->fd, &st) == 0 && st.st_size > 0)
+  {
+    keep = journalRecover(j->fd, st.st_size, &edits);
+    if (keep == -1) //written against another version of the file: set it aside rather than apply it to this one
+    {
+      char *old = xmalloc(strlen(j->path) + sizeof(".old"));
+      sprintf(old, "%s.old", j->path);
+      rename(j->path, old);
+      editorSetStatusMessage("The journal does not match %s, it was kept as %s", E.filename, old);
+      free(old);
+      close(j->fd);
+      journalOpen(0);
+      return;
+    }
+    j->based = 1;
+    editorSetStatusMessage("Recovered %d unsaved edit%s from %s", edits, edits == 1 ? "" : "s", j->path);
+  }
+  if (ftruncate(j->fd, keep) == -1) //drop a record that was cut short, the next one goes in its place
+  {
+    close(j->fd);
+    return;
+  }
+
+  j->ring = xmalloc(KILO_JOURNAL_RING);
+  j->head = j->tail = j->queued = j->notified = j->cut = 0;
+  j->over.b = NULL;
+  j->over.len = j->over.cap = j->overoff = 0;
+  j->waiting = j->stop = j->failed = 0;
+  if (pipe(j->notify) == -1) die("pipe");
+  fcntl(j->notify[0], F_SETFL, O_NONBLOCK);
+  fcntl(j->notify[1], F_SETFL, O_NONBLOCK);
+  if (pthread_create(&j->thread, NULL, journalWriter, NULL) != 0) die("pthread_create");
+  atexit(journalClose);
+  j->on = 1;
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Line Scanner ***********************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**editorScanLines splits a buffer into lines in a single pass: it records where each line ends, counts the tabs of each line
+*and counts the lines that end in \r\n. The vector kernels compare 16 or 32 bytes at a time against '\n' and '\t' and turn the results
+*into bit masks, so the per-byte cost is a few instructions per block instead of a branch per byte.
+*The kernel is picked once at runtime: AVX2 when the CPU has it, then SSE2, then the plain C loop.
+*/
+
+void scanAddLine(lineScan *out, size_t end, unsigned tabs) //record one line found by a scan kernel
+{
+  if (out->n == out->cap)
+  {
+    out->cap = out->cap ? out->cap * 2 : 1024;
+    out->end = xrealloc(out->end, sizeof(size_t) * out->cap);
+    if (out->withtabs) out->tabs = xrealloc(out->tabs, sizeof(unsigned) * out->cap);
+  }
+  out->end[out->n] = end;
+  if (out->withtabs) out->tabs[out->n] = tabs;
+  out->n++;
+}
+
+void scanMask(const char *buf, size_t pos, unsigned nl, unsigned tab, unsigned *tabs, lineScan *out) //record the lines ending in one block
+{
+  while (nl) //every set bit of nl is a newline at pos + bit
+  {
+    int bit = __builtin_ctz(nl);
+    unsigned below = (1u << bit) - 1;
+    *tabs += __builtin_popcount(tab & below);
+    tab &= ~below;
+    size_t end = pos + bit;
+    if (end > 0 && buf[end - 1] == '\r') out->crlf++;
+    scanAddLine(out, end, *tabs);
+    *tabs = 0;
+    nl &= nl - 1;
+  }
+  *tabs += __builtin_popcount(tab);
+}
+
+size_t scanScalar(const char *buf, size_t pos, size_t len, unsigned *tabs, lineScan *out) //plain C kernel, also finishes the tail of the vector kernels
+{
+  for (; pos < len; pos++)
+  {
+    if (buf[pos] == '\t')
+    {
+      (*tabs)++;
+    }
+    else if (buf[pos] == '\n')
+    {
+      if (pos > 0 && buf[pos - 1] == '\r') out->crlf++;
+      scanAddLine(out, pos, *tabs);
+      *tabs = 0;
+    }
+  }
+  return pos;
+}
+
+#ifdef __SSE2__
+size_t scanSSE2(const char *buf, size_t pos, size_t len, unsigned *tabs, lineScan *out) //16 bytes per step
+{
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i tab = _mm_set1_epi8('\t');
+  for (; pos + 16 <= len; pos += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + pos));
+    unsigned nlmask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    unsigned tabmask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+    if (nlmask == 0)
+      *tabs += __builtin_popcount(tabmask);
+    else
+      scanMask(buf, pos, nlmask, tabmask, tabs, out);
+  }
+  return scanScalar(buf, pos, len, tabs, out);
+}
+#endif
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+size_t scanAVX2(const char *buf, size_t pos, size_t len, unsigned *tabs, lineScan *out) //32 bytes per step
+{
+  const __m256i nl = _mm256_set1_epi8('\n');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  for (; pos + 32 <= len; pos += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(buf + pos));
+    unsigned nlmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    unsigned tabmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab));
+    if (nlmask == 0)
+      *tabs += __builtin_popcount(tabmask);
+    else
+      scanMask(buf, pos, nlmask, tabmask, tabs, out);
+  }
+  return scanScalar(buf, pos, len, tabs, out);
+}
+#endif
+
+void scanRun(scanKernel kernel, const char *buf, size_t len, lineScan *out) //append the lines of buf to out, found by one kernel
+{
+  unsigned tabs = 0;
+  kernel(buf, 0, len, &tabs, out);
+  if (len > 0 && buf[len - 1] != '\n') scanAddLine(out, len, tabs); //the last line has no newline
+}
+
+void editorScanLines(const char *buf, size_t len, lineScan *out) //append the lines of buf to out
+{
+  static scanKernel kernel = NULL;
+  if (!kernel)
+  {
+    kernel = scanScalar;
+#ifdef __SSE2__
+    kernel = scanSSE2;
+#endif
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) kernel = scanAVX2;
+#endif
+  }
+  scanRun(kernel, buf, len, out);
+}
+
+int scanSelfTest() //check the vector kernels against the plain C one, for kilo --selftest
+{
+  /**Random buffers of '\n', '\r\n', tabs and letters, from empty up to a few blocks long and at every alignment, go
+  *through every kernel this CPU can run, and each must find the same lines, tab counts and \r\n endings as scanScalar.
+  */
+  scanKernel kernels[3];
+  const char *names[3];
+  int nk = 0, k;
+  kernels[nk] = scanScalar;
+  names[nk++] = "scalar";
+#ifdef __SSE2__
+  kernels[nk] = scanSSE2;
+  names[nk++] = "sse2";
+#endif
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2"))
+  {
+    kernels[nk] = scanAVX2;
+    names[nk++] = "avx2";
+  }
+#endif
+
+  static char mem[4096 + 64];
+  const char alphabet[] = "\n\r\tabcdefgh";
+  int checked = 0, failed = 0;
+  size_t len;
+  srand(1);
+  for (len = 0; len <= 4096 && !failed; len = len < 160 ? len + 1 : len * 3 / 2)
+  {
+    int align;
+    for (align = 0; align < 64 && !failed; align++)
+    {
+      char *buf = mem + align;
+      int dense = rand() % 4; //from every other byte a newline or tab down to almost none
+      size_t j;
+      for (j = 0; j < len; j++)
+        buf[j] = rand() % (2 << (dense * 2)) ? 'x' : alphabet[rand() % (sizeof(alphabet) - 1)];
+
+      lineScan want = {NULL, NULL, 1, 0, 0, 0};
+      scanRun(scanScalar, buf, len, &want);
+      for (k = 1; k < nk; k++)
+      {
+        lineScan got = {NULL, NULL, 1, 0, 0, 0};
+        scanRun(kernels[k], buf, len, &got);
+        if (got.n != want.n || got.crlf != want.crlf || (want.n && (memcmp(got.end, want.end, sizeof(size_t) * want.n) ||
+            memcmp(got.tabs, want.tabs, sizeof(unsigned) * want.n))))
+        {
+          printf("scanner: %s disagrees with scalar on %zu bytes at alignment %d\n", names[k], len, align);
+          failed = 1;
+        }
+        free(got.end);
+        free(got.tabs);
+        checked++;
+      }
+      free(want.end);
+      free(want.tabs);
+    }
+  }
+  if (!failed)
+  {
+    printf("scanner: %d buffers, kernels agree:", checked);
+    for (k = 0; k < nk; k++)
+      printf(" %s", names[k]);
+    printf("\n");
+  }
+  return failed;
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Follow *****************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**With --follow the file is followed like tail -f: text appended to it shows up as new rows, and while the cursor is on
+*the last row it moves down with them, so the view keeps to the end of the file. inotify wakes the input loop when the
+*file or its directory changes, or the file is looked at every KILO_FOLLOW_POLL ms where inotify cannot watch it. The
+*new bytes are read from where the last read stopped and go in through editorInsertRows(), so a burst of lines costs one
+*arena copy and one rope insert. They are read once a frame, before it is drawn, and at most KILO_FOLLOW_FRAME bytes
+*at a time, so a log that grows faster than it can be shown still gets frames drawn. A file that is truncated, or
+*replaced by a new file of the same name as log rotation does, is read again from the start, unless the rows hold edits
+*that were not saved, which end follow mode instead. A followed file is read rather than mapped: a mapping of a file that
+*is truncated faults when its lost pages are touched. Text read from the file does not count as an edit, it is neither
+*undone nor journaled, and it does not mark the file as modified.
+*/
+
+void followWatch() //watch the followed file, and its directory for a file that takes its name
+{
+#ifdef __linux__
+  struct editorFollow *f = &E.follow;
+  if (f->notifyfd == -1) f->notifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->notifyfd == -1) return;
+  if (f->wd != -1) inotify_rm_watch(f->notifyfd, f->wd); //it watches the file that was renamed away
+  f->wd = inotify_add_watch(f->notifyfd, E.filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  if (f->dirwd == -1)
+  {
+    const char *slash = strrchr(E.filename, '/');
+    char *dir = slash ? strndup(E.filename, slash - E.filename + 1) : strdup(".");
+    f->dirwd = inotify_add_watch(f->notifyfd, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+  }
+  if (f->wd == -1 || f->dirwd == -1) //out of watches: fall back to the timer
+  {
+    close(f->notifyfd);
+    f->notifyfd = f->wd = f->dirwd = -1;
+  }
+#endif
+}
+
+void followAppend(const char *s, size_t len) //add text read from the followed file after the last row
+{
+  struct editorFollow *f = &E.follow;
+  int dirty = E.dirty;
+  if (E.numrows == 0 && !f->partial) //the first line ending tells how the file ends its lines
+  {
+    const char *nl = memchr(s, '\n', len);
+    if (nl) E.crlf = nl > s && nl[-1] == '\r';
+  }
+  if (f->partial) //the rest of the line that the last row holds the start of
+  {
+    const char *nl = memchr(s, '\n', len);
+    size_t seg = nl ? (size_t)(nl - s) : len;
+    erow *row = editorRow(E.numrows - 1);
+    editorRowsChanged(E.numrows - 1);
+    editorRowInsertString(row, row->size, s, seg);
+    if (nl)
+    {
+      if (E.crlf && row->size > 0 && editorRowCharAt(row, row->size - 1) == '\r') editorRowDelChars(row, row->size - 1, 1);
+      f->partial = 0;
+      seg++;
+    }
+    s += seg;
+    len -= seg;
+  }
+  if (len > 0)
+  {
+    f->partial = s[len - 1] != '\n';
+    editorInsertRows(E.numrows, s, f->partial ? len : len - 1, E.crlf); //the newline that ends the text starts no row
+  }
+  E.dirty = dirty;
+  E.changes++;
+}
+
+int followRead(size_t max) //turn up to about max new bytes of the followed file into rows, returns whether it stopped short of the end
+{
+  /**Only whole lines are handed on while reading, the start of a line waits in the buffer for the rest of it, so a line
+  *is not split between two reads. A line the file does not have the end of yet goes in as it is, and the rest of it is
+  *added to its row when it comes.
+  */
+  struct editorFollow *f = &E.follow;
+  struct abuf *b = &f->buf;
+  size_t total = 0;
+  b->len = 0;
+  while (total < max && abReserve(b, KILO_FOLLOW_CHUNK) == 0)
+  {
+    ssize_t n = read(f->fd, b->b + b->len, KILO_FOLLOW_CHUNK);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    f->offset += n;
+    total += n;
+    b->len += n;
+    char *nl = memrchr(b->b, '\n', b->len);
+    if (!nl) continue;
+    int whole = nl - b->b + 1;
+    followAppend(b->b, whole);
+    memmove(b->b, b->b + whole, b->len - whole);
+    b->len -= whole;
+  }
+  if (b->len > 0) followAppend(b->b, b->len);
+  b->len = 0;
+  return total >= max;
+}
+
+int followStart(int fd) //follow the file open on fd, which is E.filename: read all of it and watch for more, -1 if it cannot be followed
+{
+  struct editorFollow *f = &E.follow;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+  f->fd = fd;
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+  f->offset = 0;
+  f->partial = 0;
+  followWatch(); //before reading, so that nothing written in between is missed
+  followRead((size_t)-1);
+  return 0;
+}
+
+void followStop() //leave follow mode
+{
+  struct editorFollow *f = &E.follow;
+  if (!f->on) return;
+  close(f->fd);
+  if (f->notifyfd != -1) close(f->notifyfd);
+  f->fd = f->notifyfd = f->wd = f->dirwd = -1;
+  f->on = f->pending = 0;
+  E.changes++;
+}
+
+void followReload(const char *why) //the followed file was truncated or replaced: show it from the start again
+{
+  struct editorFollow *f = &E.follow;
+  int fd = E.dirty ? -1 : open(E.filename, O_RDONLY);
+  if (fd == -1)
+  {
+    followStop();
+    editorSetStatusMessage("%s was %s, follow mode is off%s", E.filename, why, E.dirty ? " to keep the unsaved edits" : "");
+    return;
+  }
+  int atend = E.cy >= E.numrows - 1;
+  close(f->fd);
+  ropeFree(E.rope);
+  E.rope = NULL;
+  E.numrows = 0;
+  editorRowsChanged(0);
+  E.undo.len = E.undo.pos = 0; //the edits in the log were made to the text that is gone
+  E.undo.baseid = E.undo.savedid = E.undo.nextid;
+  if (followStart(fd) == -1) //something that is not a file took its name
+  {
+    f->fd = fd;
+    followStop();
+  }
+  if (atend || E.cy >= E.numrows) E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+  E.cx = 0;
+  editorSetStatusMessage("%s was %s, %s", E.filename, why, f->on ? "reloaded" : "follow mode is off");
+}
+
+void followPump() //read what was appended to the followed file, before a frame is drawn
+{
+  struct editorFollow *f = &E.follow;
+  if (!f->on || !f->pending) return;
+  f->pending = 0;
+  struct stat st, now;
+  if (fstat(f->fd, &st) == -1) return;
+  int replaced = stat(E.filename, &now) == 0 && (now.st_ino != f->ino || now.st_dev != f->dev);
+  if (replaced || st.st_size < f->offset)
+  {
+    followReload(replaced ? "replaced" : "truncated");
+    return;
+  }
+  if (st.st_size == f->offset) return;
+
+  int atend = E.cy >= E.numrows - 1;
+  if (followRead(KILO_FOLLOW_FRAME)) //the rest goes in before the next frame
+  {
+    f->pending = 1;
+    editorWake();
+  }
+  if (atend && E.cy < E.numrows - 1)
+  {
+    E.cy = E.numrows - 1;
+    E.cx = 0;
+  }
+}
+
+void followSaved(size_t len) //the rows were saved, which put a new file of len bytes in place of the followed one: follow that
+{
+  struct editorFollow *f = &E.follow;
+  if (!f->on) return;
+  int fd = open(E.filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || lseek(fd, len, SEEK_SET) == -1)
+  {
+    if (fd != -1) close(fd);
+    return;
+  }
+  close(f->fd);
+  f->fd = fd;
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+  f->offset = len;
+  f->partial = 0; //every row was written with a line ending
+  followWatch();
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** File I/O ***************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+
+int saveFlush(struct saveBatch *b) //write out everything queued in a batch, following short writes
+{
+  struct iovec *iov = b->iov;
+  int iovcnt = b->iovcnt;
+  while (iovcnt > 0)
+  {
+    ssize_t n = writev(b->fd, iov, iovcnt);
+    if (n == -1)
+    {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    b->total += n;
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) //drop the pieces that were written completely
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) //and skip the written part of the first one that was not
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  b->iovcnt = 0;
+  b->stagelen = 0;
+  return 0;
+}
+
+int saveAppend(struct saveBatch *b, const char *s, size_t len) //queue a piece of text for writing
+{
+  if (len == 0) return 0;
+  if (len >= KILO_SAVE_COPY_MAX) //long pieces are written straight from where they are
+  {
+    if (b->iovcnt == KILO_SAVE_IOV && saveFlush(b) == -1) return -1;
+    b->iov[b->iovcnt].iov_base = (char *)s;
+    b->iov[b->iovcnt].iov_len = len;
+    b->iovcnt++;
+    return 0;
+  }
+  if (b->stagelen + len > KILO_SAVE_STAGE && saveFlush(b) == -1) return -1;
+  char *dst = b->stage + b->stagelen;
+  memcpy(dst, s, len);
+  b->stagelen += len;
+  struct iovec *last = b->iovcnt ? &b->iov[b->iovcnt - 1] : NULL;
+  if (last && (char *)last->iov_base + last->iov_len == dst) //grow the piece that already ends here
+  {
+    last->iov_len += len;
+    return 0;
+  }
+  if (b->iovcnt == KILO_SAVE_IOV)
+  {
+    if (saveFlush(b) == -1) return -1;
+    memmove(b->stage, dst, len); //the flush emptied the stage
+    dst = b->stage;
+    b->stagelen = len;
+  }
+  b->iov[b->iovcnt].iov_base = dst;
+  b->iov[b->iovcnt].iov_len = len;
+  b->iovcnt++;
+  return 0;
+}
+
+int saveRows(struct saveBatch *b) //stream every row to a batch, straight from the rope
+{
+  /**Leaves whose rows were never built are still one contiguous run of the file mapping, newlines included, and
+  *are written from it in one piece, unless the file mixes line endings: then their lines are written one by one with
+  *eol, as built rows are. Built rows are written as the two halves around their gap.
+  */
+  const char *eol = E.crlf ? "\r\n" : "\n";
+  int eollen = E.crlf ? 2 : 1;
+  int at = 0;
+  while (at < E.numrows)
+  {
+    int idx, j;
+    rnode *leaf = ropeDescend(at, &idx, 0, 0);
+    if (!leaf->rows && leaf->line0 >= 0 && !E.eolmixed)
+    {
+      int last = leaf->line0 + leaf->n - 1;
+      size_t start = leaf->line0 ? E.lineend[leaf->line0 - 1] + 1 : 0;
+      size_t end = E.lineend[last];
+      if (end < E.maplen) end++; //take the newline along, unless the file ended without one
+      if (saveAppend(b, E.map + start, end - start) == -1) return -1;
+      if (end == E.maplen && E.map[end - 1] != '\n' && saveAppend(b, eol, eollen) == -1) return -1;
+    }
+    else if (!leaf->rows && leaf->line0 >= 0)
+    {
+      for (j = 0; j < leaf->n; j++)
+      {
+        char *s;
+        int len;
+        editorMappedLine(leaf->line0 + j, &s, &len);
+        if (saveAppend(b, s, len) == -1) return -1;
+        if (saveAppend(b, eol, eollen) == -1) return -1;
+      }
+    }
+    else
+    {
+      for (j = 0; j < leaf->n; j++)
+      {
+        erow *row = &leaf->rows[j];
+        if (saveAppend(b, row->chars, row->gap) == -1) return -1;
+        if (saveAppend(b, &row->chars[row->gap + row->gaplen], row->size - row->gap) == -1) return -1;
+        if (saveAppend(b, eol, eollen) == -1) return -1;
+      }
+    }
+    at += leaf->n;
+  }
+  return saveFlush(b);
+}
+
+int editorWriteFile(const char *filename, size_t *written) //write the rows to a temporary file, then atomically replace filename with it
+{
+  /**The original file is never truncated: the new contents go to a temporary file in the same directory, which is
+  *fsync'ed and then renamed over the original, so a crash during the save leaves either the old or the new file.
+  *The file keeps its permission bits. A symlink is followed, so the file it points to is the one replaced.
+  */
+  char *path = realpath(filename, NULL);
+  if (!path) path = strdup(filename); //a new file
+  struct stat st;
+  int exists = stat(path, &st) == 0;
+
+  char *slash = strrchr(path, '/');
+  int dirlen = slash ? slash - path + 1 : 0;
+  char *tmp = xmalloc(strlen(path) + 16);
+  sprintf(tmp, "%.*s.%s.XXXXXX", dirlen, path, slash ? slash + 1 : path);
+
+  int fd = mkstemp(tmp);
+  if (fd == -1)
+  {
+    free(tmp);
+    free(path);
+    return -1;
+  }
+
+  mode_t mask = umask(0);
+  umask(mask);
+  fchmod(fd, exists ? (st.st_mode & 07777) : (0644 & ~mask));
+  if (exists && fchown(fd, st.st_uid, st.st_gid) == -1) {} //only root can give the file away, keep our own otherwise
+
+  struct saveBatch b;
+  b.fd = fd;
+  b.iov = xmalloc(sizeof(struct iovec) * KILO_SAVE_IOV);
+  b.iovcnt = 0;
+  b.stage = xmalloc(KILO_SAVE_STAGE);
+  b.stagelen = 0;
+  b.total = 0;
+
+  int ret = saveRows(&b);
+  if (ret == 0) ret = fsync(fd);
+  if (close(fd) == -1) ret = -1;
+  if (ret == 0) ret = rename(tmp, path);
+  if (ret == 0) //make the rename itself durable
+  {
+    char *dir = dirlen ? strndup(path, dirlen) : strdup(".");
+    int dfd = open(dir, O_RDONLY);
+    if (dfd != -1)
+    {
+      fsync(dfd);
+      close(dfd);
+    }
+    free(dir);
+  }
+  else
+  {
+    int err = errno;
+    unlink(tmp);
+    errno = err;
+  }
+
+  *written = b.total;
+  free(b.iov);
+  free(b.stage);
+  free(tmp);
+  free(path);
+  return ret;
+}
+
+int editorOpenMapped(int fd) //map a regular file and index its lines; rows are only built for leaves that get used
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return -1;
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return -1;
+  madvise(map, st.st_size, MADV_SEQUENTIAL); //the index is built in one forward pass
+
+  lineScan scan = {NULL, NULL, 1, 0, 0, 0};
+  editorScanLines(map, st.st_size, &scan);
+  madvise(map, st.st_size, MADV_RANDOM);
+
+  size_t nlines = scan.n;
+  E.map = map;
+  E.maplen = st.st_size;
+  E.lineend = scan.end;
+  E.maplines = nlines;
+  E.linetabs = scan.tabs;
+  E.crlf = scan.crlf > nlines / 2; //a file that mixes endings is saved with the ones most of its lines have
+  E.eolmixed = scan.crlf != (E.crlf ? nlines - (map[st.st_size - 1] != '\n') : 0);
+
+  size_t line;
+  for (line = 0; line < nlines; line += KILO_ROPE_LEAF_MAX) //one unbuilt leaf per KILO_ROPE_LEAF_MAX lines
+  {
+    rnode *t = ropeNewLeaf();
+    t->line0 = line;
+    t->n = nlines - line < KILO_ROPE_LEAF_MAX ? (int)(nlines - line) : KILO_ROPE_LEAF_MAX;
+    ropeUpdate(t);
+    E.rope = ropeMerge(E.rope, t);
+  }
+  E.numrows = nlines;
+  return 0;
+}
+
+void editorOpen(char *filename) //open a file and load its contents into the editor
+{
+  free(E.filename);
+  E.filename = strdup(filename);
+  editorSelectSyntax();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+  if (E.follow.on && followStart(fd) == 0) //a followed file is read, see the Follow section
+  {
+    E.cy = E.numrows > 0 ? E.numrows - 1 : 0; //start at the end, where the file grows
+    E.dirty = 0;
+    return;
+  }
+  E.follow.on = 0; //only a regular file can be followed
+  if (editorOpenMapped(fd) == 0)
+  {
+    close(fd); //the mapping stays valid after the descriptor is closed
+    E.dirty = 0;
+    return;
+  }
+
+  FILE *fp = fdopen(fd, "r"); //not a regular file, or it cannot be mapped: read it whole and scan it
+  if (!fp) die("fdopen");
+
+  size_t len = 0, cap = 65536;
+  char *buf = xmalloc(cap);
+  size_t nread;
+  while ((nread = fread(buf + len, 1, cap - len, fp)) > 0)
+  {
+    len += nread;
+    if (len == cap)
+    {
+      cap *= 2;
+      buf = xrealloc(buf, cap);
+    }
+  }
+  fclose(fp);
+
+  lineScan scan = {NULL, NULL, 1, 0, 0, 0};
+  editorScanLines(buf, len, &scan);
+  arenaAdd(buf, cap, len); //the buffer becomes an arena block, and the rows views into it
+  E.rope = ropeMerge(E.rope, ropeBuild(buf, &scan, 1));
+  E.numrows += scan.n;
+  E.crlf = scan.crlf > scan.n / 2;
+  free(scan.end);
+  free(scan.tabs);
+  E.dirty = 0; //reset the dirty flag
+}
+
+int eolSelfTest() //open a file that mixes line endings over several leaves and check how it is saved, for kilo --selftest
+{
+  /**Two lines of the file, in different leaves, end in \r\n and all the others in \n, so it is saved with \n throughout:
+  *straight after it is opened, when no leaf was built, and again once every leaf was.
+  */
+  char path[] = "/tmp/kilo-selftest-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) return 1;
+  FILE *fp = fdopen(fd, "w");
+  int j, lines = KILO_ROPE_LEAF_MAX * 2 + 44;
+  for (j = 0; j < lines; j++)
+    fprintf(fp, "line %d%s", j, j == 4 || j == lines - 10 ? "\r\n" : "\n");
+  fclose(fp);
+  editorOpen(path);
+
+  int built, failed = 0;
+  for (built = 0; built < 2 && !failed; built++)
+  {
+    if (built)
+      for (j = 0; j < E.numrows; j++)
+        editorRow(j);
+    char buf[8192], want[32];
+    size_t len, pos = 0;
+    failed = editorWriteFile(path, &len) == -1 || !(fp = fopen(path, "r"));
+    if (failed) break;
+    len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    for (j = 0; j < lines && !failed; j++)
+    {
+      size_t n = snprintf(want, sizeof(want), "line %d\n", j);
+      failed = pos + n > len || memcmp(buf + pos, want, n) != 0;
+      pos += n;
+    }
+    failed |= pos != len;
+  }
+  unlink(path);
+  printf("line endings: %d lines of mixed endings %s\n", lines, failed ? "are saved wrong" : "are saved with \\n, with or without built leaves");
+  return failed;
+}
+
+void editorSave() //save the contents of the editor to disk
+{
+  if(E.filename == NULL)
+  {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel) ", NULL);
+    if(E.filename == NULL)
+    {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntax();
+  }
+
+  struct timespec start, end;
+  size_t len;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (editorWriteFile(E.filename, &len) == 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    E.dirty = 0; //reset the dirty flag
+    E.undo.savedid = undoState(); //undoing back to this point makes the file clean again
+    if (E.journal.on) journalCut();
+    else journalOpen(0); //a new file, its edits are journaled from now on
+    followSaved(len);
+    editorSetStatusMessage("%zu bytes written to disk (%.1f MB/s)", len, secs > 0 ? len / secs / 1e6 : 0.0);
+    return;
+  }
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno)); //set the status message to an error message
+
+}
+
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Regex ******************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+
+/**A small regular expression engine for the search prompt. A pattern is parsed into a tree, and the tree is compiled into
+*two Thompson NFA programs, one for the pattern and one for the pattern read backwards. The programs are never run
+*instruction by instruction: they are turned into DFA states on demand, one state for every set of instructions that can be
+*active at once, and a state remembers where each byte leads once that has been worked out. A line is read at most once in
+*each direction, so a search takes time linear in the length of the text whatever the pattern, with no backtracking.
+*The leftmost match is found by running the backward program over the line from its end, starting a match at every
+*position, and keeping the last position where it accepts; the forward program, started there, then finds the longest
+*match. Every position where the backward program accepts is kept in a bitmap, so that looking for the next match of the
+*same line does not read the line again. Patterns that begin with a literal string let the search jump straight to where that string occurs and run the
+*forward program only there.
+*Supported: literal bytes, '.', [classes] with ranges and negation, \d \w \s and their negations \D \W \S, \t \n \r, ^ and $,
+*(groups), '|', and the repeats * + ? {m} {m,} {m,n}.
+*/
+
+enum rxType                     //kinds of node in the tree a pattern is parsed into
+{
+  RXT_EMPTY,  //matches the empty string
+  RXT_CLASS,  //a byte from a set
+  RXT_BOL,    //the beginning of the line
+  RXT_EOL,    //the end of the line
+  RXT_CAT,    //a followed by b
+  RXT_ALT,    //a or b
+  RXT_REPEAT  //a, between min and max times
+};
+
+enum rxOp                       //instructions of an NFA program
+{
+  RX_BYTE,  //read a byte from the set, then go on with the next instruction
+  RX_SPLIT, //go on with both x and y
+  RX_JMP,   //go on with x
+  RX_BOL,   //go on with the next instruction at the beginning of the line
+  RX_EOL,   //go on with the next instruction at the end of the line
+  RX_MATCH  //the pattern matched
+};
+
+typedef struct rxnode           //a node of the tree a pattern is parsed into
+{
+  int type; //an rxType
+  unsigned char cls[32]; //for RXT_CLASS, one bit for every byte the node matches
+  int a, b; //the children, as indexes into the tree
+  int min, max; //for RXT_REPEAT, the bounds, max is -1 when there is none
+} rxnode;
+
+typedef struct rxinst           //an instruction of an NFA program
+{
+  int op; //an rxOp
+  int x, y; //the targets of RX_SPLIT and RX_JMP
+  unsigned char cls[32]; //for RX_BYTE, the bytes it reads
+} rxinst;
+
+typedef struct regex            //a compiled pattern
+{
+  rxinst *fwd, *rev; //the program of the pattern, and of the pattern read backwards
+  int nfwd, nrev; //their lengths
+  char *prefix; //a literal string every match starts with
+  int prefixlen; //its length, 0 when there is none
+} regex;
+
+typedef struct rxstate          //a DFA state: a set of NFA instructions that are active at once
+{
+  int *set; //the RX_BYTE, RX_EOL and RX_MATCH instructions of the set, sorted
+  int n; //size of set, 0 for the state that can never match again
+  int accept; //the set holds RX_MATCH
+  int acceptend; //the set reaches RX_MATCH at the end of the line
+  int next[256]; //the state each byte leads to, -1 until it is worked out
+} rxstate;
+
+typedef struct rxdfa            //a DFA built lazily from an NFA program
+{
+  rxinst *prog; //the program
+  int nprog; //its length
+  int unanchored; //the program is restarted at every position, so a match may start anywhere
+  rxstate *states; //room for KILO_REGEX_DFA_MAX states
+  int nstates; //states built so far
+  int *table; //hash table of the states by their sets, -1 for an empty slot
+  int *mark; //for every instruction, the generation it was last added to the set being built in
+  int gen; //the current generation
+  int *stack; //work stack for following the instructions that read nothing
+  int *scratch; //the set being built
+  int nscratch; //its size
+  int start[2]; //the state a search starts in, in the middle [0] and at the beginning [1] of a line, -1 until built
+} rxdfa;
+
+typedef struct regexCache       //the DFAs of a pattern; every thread that searches needs its own
+{
+  regex *re; //the pattern
+  rxdfa fwd; //the forward program, anchored at the position a search starts from
+  rxdfa rev; //the backward program, unanchored
+  const char *line; //the line the backward program last read, NULL before the first
+  int linelen; //its length
+  int linefrom; //the first column it was read back to
+  unsigned long long *starts; //bit i is set when a match starts at column linefrom + i of line
+  int startscap; //words in starts
+} regexCache;
+
+typedef struct rxparser         //state of the parser
+{
+  const char *p; //the rest of the pattern
+  rxnode *nodes; //the tree
+  int n, cap; //nodes used and allocated
+  const char *error; //why the pattern is not valid, NULL while it is
+} rxparser;
+
+typedef struct rxcompiler       //state of the compiler
+{
+  rxnode *nodes; //the tree
+  rxinst *prog; //the program
+  int n, cap; //instructions used and allocated
+  int reverse; //compile the pattern read backwards
+  const char *error; //why the pattern cannot be compiled, NULL while it can
+} rxcompiler;
+
+int rxNode(rxparser *ps, int type, int a, int b) //add a node to the tree
+{
+  if (ps->n == ps->cap)
+  {
+    ps->cap = ps->cap ? ps->cap * 2 : 16;
+    ps->nodes = realloc(ps->nodes, sizeof(rxnode) * ps->cap);
+  }
+  rxnode *nd = &ps->nodes[ps->n];
+  memset(nd, 0, sizeof(rxnode));
+  nd->type = type;
+  nd->a = a;
+  nd->b = b;
+  return ps->n++;
+}
+
+void rxClassAdd(unsigned char *cls, int lo, int hi) //add the bytes lo to hi to a class
+{
+  int c;
+  for (c = lo; c <= hi; c++)
+    cls[c >> 3] |= 1 << (c & 7);
+}
+
+int rxClassEscape(unsigned char *cls, int c) //add the bytes of \d, \w, \s or their negations to a class, 0 if c is none of them
+{
+  unsigned char set[32];
+  int j;
+  memset(set, 0, sizeof(set));
+  switch (tolower(c))
+  {
+    case 'd': rxClassAdd(set, '0', '9'); break;
+    case 'w': rxClassAdd(set, '0', '9'); rxClassAdd(set, 'a', 'z'); rxClassAdd(set, 'A', 'Z'); rxClassAdd(set, '_', '_'); break;
+    case 's': rxClassAdd(set, '\t', '\r'); rxClassAdd(set, ' ', ' '); break;
+    default: return 0;
+  }
+  for (j = 0; j < 32; j++)
+    cls[j] |= isupper(c) ? ~set[j] : set[j];
+  return 1;
+}
+
+int rxEscapeByte(int c) //the byte an escaped character stands for
+{
+  switch (c)
+  {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    default: return c;
+  }
+}
+
+int rxParseAlt(rxparser *ps);
+
+int rxParseClass(rxparser *ps) //parse a [class], whose opening bracket has been read
+{
+  unsigned char cls[32];
+  int negate = 0, first = 1, j;
+  memset(cls, 0, sizeof(cls));
+  if (*ps->p == '^')
+  {
+    negate = 1;
+    ps->p++;
+  }
+  while (*ps->p && (*ps->p != ']' || first)) //a ']' right after the bracket is an ordinary byte
+  {
+    first = 0;
+    int lo = (unsigned char)*ps->p++;
+    if (lo == '\\' && *ps->p)
+    {
+      int e = (unsigned char)*ps->p++;
+      if (rxClassEscape(cls, e)) continue;
+      lo = rxEscapeByte(e);
+    }
+    int hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']')
+    {
+      ps->p++;
+      hi = (unsigned char)*ps->p++;
+      if (hi == '\\' && *ps->p) hi = rxEscapeByte((unsigned char)*ps->p++);
+      if (hi < lo) ps->error = "bad range";
+    }
+    rxClassAdd(cls, lo, hi);
+  }
+  if (*ps->p != ']') ps->error = "missing ]";
+  else ps->p++;
+
+  int nd = rxNode(ps, RXT_CLASS, -1, -1);
+  for (j = 0; j < 32; j++)
+    ps->nodes[nd].cls[j] = negate ? ~cls[j] : cls[j];
+  return nd;
+}
+
+int rxParseAtom(rxparser *ps) //parse a single byte, class, anchor or group
+{
+  int c = (unsigned char)*ps->p++, nd;
+  switch (c)
+  {
+    case '(':
+      if (ps->p[0] == '?' && ps->p[1] == ':') ps->p += 2; //groups never capture, so (?: is the same as (
+      nd = rxParseAlt(ps);
+      if (*ps->p != ')')
+      {
+        if (!ps->error) ps->error = "missing )";
+      }
+      else ps->p++;
+      return nd;
+    case '[':
+      return rxParseClass(ps);
+    case '^':
+      return rxNode(ps, RXT_BOL, -1, -1);
+    case '$':
+      return rxNode(ps, RXT_EOL, -1, -1);
+    case '.':
+      nd = rxNode(ps, RXT_CLASS, -1, -1);
+      memset(ps->nodes[nd].cls, 0xff, 32);
+      return nd;
+    case '*':
+    case '+':
+    case '?':
+      ps->error = "nothing to repeat";
+      return rxNode(ps, RXT_EMPTY, -1, -1);
+    case '\\':
+      if (!*ps->p)
+      {
+        ps->error = "trailing \\";
+        return rxNode(ps, RXT_EMPTY, -1, -1);
+      }
+      c = (unsigned char)*ps->p++;
+      nd = rxNode(ps, RXT_CLASS, -1, -1);
+      if (!rxClassEscape(ps->nodes[nd].cls, c)) rxClassAdd(ps->nodes[nd].cls, rxEscapeByte(c), rxEscapeByte(c));
+      return nd;
+  }
+  nd = rxNode(ps, RXT_CLASS, -1, -1);
+  rxClassAdd(ps->nodes[nd].cls, c, c);
+  return nd;
+}
+
+int rxParseRepeat(rxparser *ps) //parse an atom and the repeats that follow it
+{
+  int nd = rxParseAtom(ps);
+  while (!ps->error)
+  {
+    int min, max;
+    char c = *ps->p;
+    if (c == '*') { min = 0; max = -1; }
+    else if (c == '+') { min = 1; max = -1; }
+    else if (c == '?') { min = 0; max = 1; }
+    else if (c == '{' && isdigit((unsigned char)ps->p[1]))
+    {
+      char *end;
+      long lo = strtol(ps->p + 1, &end, 10), hi = lo; //checked before they become ints, a huge count must not wrap around
+      if (*end == ',')
+      {
+        end++;
+        hi = isdigit((unsigned char)*end) ? strtol(end, &end, 10) : -1;
+      }
+      if (*end != '}') break; //not a repeat after all: the brace is an ordinary byte
+      if (lo > KILO_REGEX_REPEAT_MAX || hi > KILO_REGEX_REPEAT_MAX || (hi != -1 && hi < lo))
+      {
+        ps->error = "bad repeat count";
+        break;
+      }
+      min = lo;
+      max = hi;
+      ps->p = end;
+    }
+    else break;
+    ps->p++;
+    if (*ps->p == '?') ps->p++; //a lazy repeat finds the same matches: the longest match always wins here
+
+    int r = rxNode(ps, RXT_REPEAT, nd, -1);
+    ps->nodes[r].min = min;
+    ps->nodes[r].max = max;
+    nd = r;
+  }
+  return nd;
+}
+
+int rxParseCat(rxparser *ps) //parse a sequence of repeats
+{
+  int nd = rxNode(ps, RXT_EMPTY, -1, -1);
+  while (*ps->p && *ps->p != '|' && *ps->p != ')' && !ps->error)
+  {
+    int next = rxParseRepeat(ps);
+    nd = rxNode(ps, RXT_CAT, nd, next);
+  }
+  return nd;
+}
+
+int rxParseAlt(rxparser *ps) //parse sequences separated by '|'
+{
+  int nd = rxParseCat(ps);
+  while (*ps->p == '|' && !ps->error)
+  {
+    ps->p++;
+    int next = rxParseCat(ps);
+    nd = rxNode(ps, RXT_ALT, nd, next);
+  }
+  return nd;
+}
+
+int rxEmit(rxcompiler *c, int op, int x, int y) //add an instruction to the program, returns its index
+{
+  if (c->n == KILO_REGEX_PROG_MAX)
+  {
+    c->error = "pattern too large";
+    return 0;
+  }
+  if (c->n == c->cap)
+  {
+    c->cap = c->cap ? c->cap * 2 : 64;
+    c->prog = realloc(c->prog, sizeof(rxinst) * c->cap);
+  }
+  rxinst *in = &c->prog[c->n];
+  memset(in, 0, sizeof(rxinst));
+  in->op = op;
+  in->x = x;
+  in->y = y;
+  return c->n++;
+}
+
+void rxGen(rxcompiler *c, int i) //compile a node of the tree
+{
+  if (c->error) return;
+  rxnode *nd = &c->nodes[i];
+  int j, k, chain;
+  switch (nd->type)
+  {
+    case RXT_CLASS:
+      j = rxEmit(c, RX_BYTE, 0, 0);
+      memcpy(c->prog[j].cls, nd->cls, 32);
+      break;
+    case RXT_BOL: //read backwards, the beginning of the line is where the text ends
+      rxEmit(c, c->reverse ? RX_EOL : RX_BOL, 0, 0);
+      break;
+    case RXT_EOL:
+      rxEmit(c, c->reverse ? RX_BOL : RX_EOL, 0, 0);
+      break;
+    case RXT_CAT:
+      rxGen(c, c->reverse ? nd->b : nd->a);
+      rxGen(c, c->reverse ? nd->a : nd->b);
+      break;
+    case RXT_ALT:
+      j = rxEmit(c, RX_SPLIT, c->n + 1, 0);
+      rxGen(c, nd->a);
+      k = rxEmit(c, RX_JMP, 0, 0);
+      c->prog[j].y = c->n;
+      rxGen(c, nd->b);
+      c->prog[k].x = c->n;
+      break;
+    case RXT_REPEAT:
+      for (j = 0; j < nd->min; j++)
+        rxGen(c, nd->a);
+      if (nd->max == -1) //a loop
+      {
+        j = rxEmit(c, RX_SPLIT, c->n + 1, 0);
+        rxGen(c, nd->a);
+        rxEmit(c, RX_JMP, j, 0);
+        c->prog[j].y = c->n;
+        break;
+      }
+      chain = -1; //each optional copy may skip to the end; the splits are chained through y until the end is known
+      for (j = nd->min; j < nd->max && !c->error; j++)
+      {
+        k = rxEmit(c, RX_SPLIT, c->n + 1, chain);
+        rxGen(c, nd->a);
+        chain = k;
+      }
+      while (chain != -1 && !c->error)
+      {
+        k = c->prog[chain].y;
+        c->prog[chain].y = c->n;
+        chain = k;
+      }
+      break;
+  }
+}
+
+int rxPrefix(rxnode *nodes, int i, regex *re) //add the literal that every match of a node starts with to the prefix,
+{                                             //returns whether the node matches exactly that literal
+  rxnode *nd = &nodes[i];
+  int c = 0, n = 0, j;
+  switch (nd->type)
+  {
+    case RXT_EMPTY:
+    case RXT_BOL:
+      return 1;
+    case RXT_CLASS:
+      for (j = 0; j < 256; j++)
+        if (nd->cls[j >> 3] & (1 << (j & 7)))
+        {
+          c = j;
+          n++;
+        }
+      if (n != 1) return 0;
+      re->prefix[re->prefixlen++] = c;
+      return 1;
+    case RXT_CAT:
+      return rxPrefix(nodes, nd->a, re) && rxPrefix(nodes, nd->b, re);
+    case RXT_REPEAT:
+      if (nd->min == 0) return 0;
+      return rxPrefix(nodes, nd->a, re) && nd->max == 1;
+    default:
+      return 0;
+  }
+}
+
+rxinst *rxCompile(rxnode *nodes, int root, int reverse, int *n, const char **error) //compile the tree into a program
+{
+  rxcompiler c;
+  memset(&c, 0, sizeof(c));
+  c.nodes = nodes;
+  c.reverse = reverse;
+  rxGen(&c, root);
+  rxEmit(&c, RX_MATCH, 0, 0);
+  if (c.error)
+  {
+    free(c.prog);
+    *error = c.error;
+    return NULL;
+  }
+  *n = c.n;
+  return c.prog;
+}
+
+regex *regexCompile(const char *pattern, const char **error) //compile a pattern, NULL with a reason in error if it is not valid
+{
+  rxparser ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.p = pattern;
+  int root = rxParseAlt(&ps);
+  if (!ps.error && *ps.p == ')') ps.error = "unmatched )";
+  *error = ps.error;
+
+  regex *re = NULL;
+  if (!ps.error)
+  {
+    re = calloc(1, sizeof(regex));
+    re->fwd = rxCompile(ps.nodes, root, 0, &re->nfwd, error);
+    re->rev = rxCompile(ps.nodes, root, 1, &re->nrev, error);
+    re->prefix = malloc(strlen(pattern) + 1);
+    rxPrefix(ps.nodes, root, re);
+    if (!re->fwd || !re->rev)
+    {
+      free(re->fwd);
+      free(re->rev);
+      free(re->prefix);
+      free(re);
+      re = NULL;
+    }
+  }
+  free(ps.nodes);
+  return re;
+}
+
+void regexFree(regex *re)
+{
+  if (!re) return;
+  free(re->fwd);
+  free(re->rev);
+  free(re->prefix);
+  free(re);
+}
+
+void rxDfaFlush(rxdfa *d) //forget every state, when there is no room left for a new one
+{
+  int j;
+  for (j = 0; j < d->nstates; j++)
+    free(d->states[j].set);
+  d->nstates = 0;
+  for (j = 0; j < KILO_REGEX_DFA_MAX * 2; j++)
+    d->table[j] = -1;
+  d->start[0] = d->start[1] = -1;
+}
+
+void rxDfaInit(rxdfa *d, rxinst *prog, int nprog, int unanchored)
+{
+  d->prog = prog;
+  d->nprog = nprog;
+  d->unanchored = unanchored;
+  d->states = malloc(sizeof(rxstate) * KILO_REGEX_DFA_MAX);
+  d->table = malloc(sizeof(int) * KILO_REGEX_DFA_MAX * 2);
+  d->mark = calloc(nprog, sizeof(int));
+  d->gen = 0;
+  d->stack = malloc(sizeof(int) * (nprog * 2 + 1)); //an instruction pushes at most two others, the first time it is reached
+  d->scratch = malloc(sizeof(int) * nprog);
+  d->nstates = 0;
+  rxDfaFlush(d);
+}
+
+void rxDfaFree(rxdfa *d)
+{
+  rxDfaFlush(d);
+  free(d->states);
+  free(d->table);
+  free(d->mark);
+  free(d->stack);
+  free(d->scratch);
+}
+
+void rxClosure(rxdfa *d, int pc, int atstart, int atend) //add pc, and every instruction it reaches without reading, to scratch
+{
+  int sp = 0;
+  d->stack[sp++] = pc;
+  while (sp)
+  {
+    pc = d->stack[--sp];
+    if (d->mark[pc] == d->gen) continue;
+    d->mark[pc] = d->gen;
+    rxinst *in = &d->prog[pc];
+    switch (in->op)
+    {
+      case RX_JMP:
+        d->stack[sp++] = in->x;
+        break;
+      case RX_SPLIT:
+        d->stack[sp++] = in->y;
+        d->stack[sp++] = in->x;
+        break;
+      case RX_BOL:
+        if (atstart) d->stack[sp++] = pc + 1;
+        break;
+      case RX_EOL: //kept in the set until it is known whether the line ends here
+        if (atend) d->stack[sp++] = pc + 1;
+        else d->scratch[d->nscratch++] = pc;
+        break;
+      default:
+        d->scratch[d->nscratch++] = pc;
+        break;
+    }
+  }
+}
+
+int rxCmpInt(const void *a, const void *b)
+{
+  return *(const int *)a - *(const int *)b;
+}
+
+int rxIntern(rxdfa *d) //the state for the set in scratch, built if it is new; -1 when there is no room for it
+{
+  int n = d->nscratch, j;
+  qsort(d->scratch, n, sizeof(int), rxCmpInt);
+  unsigned h = 2166136261u;
+  for (j = 0; j < n; j++)
+    h = (h ^ d->scratch[j]) * 16777619u;
+
+  int mask = KILO_REGEX_DFA_MAX * 2 - 1, slot = h & mask;
+  for (; d->table[slot] != -1; slot = (slot + 1) & mask)
+  {
+    rxstate *s = &d->states[d->table[slot]];
+    if (s->n == n && memcmp(s->set, d->scratch, sizeof(int) * n) == 0) return d->table[slot];
+  }
+  if (d->nstates == KILO_REGEX_DFA_MAX) return -1;
+
+  rxstate *s = &d->states[d->nstates];
+  s->set = malloc(sizeof(int) * (n ? n : 1));
+  memcpy(s->set, d->scratch, sizeof(int) * n);
+  s->n = n;
+  s->accept = 0;
+  for (j = 0; j < n; j++)
+    if (d->prog[s->set[j]].op == RX_MATCH) s->accept = 1;
+  memset(s->next, -1, sizeof(s->next));
+
+  d->gen++; //whether the line may end here: follow the RX_EOL instructions
+  d->nscratch = 0;
+  for (j = 0; j < n; j++)
+    if (d->prog[s->set[j]].op == RX_EOL) rxClosure(d, s->set[j] + 1, 0, 1);
+  s->acceptend = s->accept;
+  for (j = 0; j < d->nscratch; j++)
+    if (d->prog[d->scratch[j]].op == RX_MATCH) s->acceptend = 1;
+
+  d->table[slot] = d->nstates;
+  return d->nstates++;
+}
+
+int rxInternOrFlush(rxdfa *d) //the state for the set in scratch, making room for it if the cache is full
+{
+  int st = rxIntern(d);
+  if (st != -1) return st;
+  int n = d->nscratch; //flushing keeps scratch, so the set can be added again
+  rxDfaFlush(d);
+  d->nscratch = n;
+  return rxIntern(d);
+}
+
+int rxStart(rxdfa *d, int atstart) //the state a search starts in
+{
+  if (d->start[atstart] == -1)
+  {
+    d->gen++;
+    d->nscratch = 0;
+    rxClosure(d, 0, atstart, 0);
+    int st = rxInternOrFlush(d);
+    d->start[atstart] = st;
+  }
+  return d->start[atstart];
+}
+
+int rxStep(rxdfa *d, int st, int c) //the state reached from st by reading byte c
+{
+  if (d->states[st].next[c] != -1) return d->states[st].next[c];
+
+  rxstate *s = &d->states[st];
+  int j;
+  d->gen++;
+  d->nscratch = 0;
+  for (j = 0; j < s->n; j++)
+  {
+    rxinst *in = &d->prog[s->set[j]];
+    if (in->op == RX_BYTE && (in->cls[c >> 3] & (1 << (c & 7)))) rxClosure(d, s->set[j] + 1, 0, 0);
+  }
+  if (d->unanchored) rxClosure(d, 0, 0, 0); //a match may also start right here
+
+  int next = rxIntern(d);
+  if (next == -1) return rxInternOrFlush(d); //the cache was flushed: st is gone, so the step is not remembered
+  d->states[st].next[c] = next;
+  return next;
+}
+
+regexCache *regexCacheNew(regex *re) //the DFAs for searching with a pattern
+{
+  regexCache *rc = malloc(sizeof(regexCache));
+  rc->re = re;
+  rxDfaInit(&rc->fwd, re->fwd, re->nfwd, 0);
+  rxDfaInit(&rc->rev, re->rev, re->nrev, 1);
+  rc->line = NULL;
+  rc->linelen = rc->linefrom = rc->startscap = 0;
+  rc->starts = NULL;
+  return rc;
+}
+
+void regexCacheFree(regexCache *rc)
+{
+  if (!rc) return;
+  rxDfaFree(&rc->fwd);
+  rxDfaFree(&rc->rev);
+  free(rc->starts);
+  free(rc);
+}
+
+int rxEmptyLine(rxdfa *d) //whether the program matches an empty line, which is both its beginning and its end
+{
+  int j;
+  d->gen++;
+  d->nscratch = 0;
+  rxClosure(d, 0, 1, 1);
+  for (j = 0; j < d->nscratch; j++)
+    if (d->prog[d->scratch[j]].op == RX_MATCH) return 1;
+  return 0;
+}
+
+int regexMatchAt(regexCache *rc, const char *s, int len, int at) //end of the longest match starting at 'at', -1 if none does
+{
+  rxdfa *d = &rc->fwd;
+  if (len == 0) return rxEmptyLine(d) ? 0 : -1;
+  int st = rxStart(d, at == 0), end = -1, i;
+  for (i = at; ; i++)
+  {
+    rxstate *cur = &d->states[st];
+    if (cur->accept || (i == len && cur->acceptend)) end = i;
+    if (i == len || cur->n == 0) break;
+    st = rxStep(d, st, (unsigned char)s[i]);
+  }
+  return end;
+}
+
+void regexLineStarts(regexCache *rc, const char *s, int len, int from) //find every column from 'from' on where a match starts
+{
+  int words = (len - from) / 64 + 1;
+  if (words > rc->startscap)
+  {
+    rc->startscap = words;
+    rc->starts = realloc(rc->starts, sizeof(unsigned long long) * words);
+  }
+  memset(rc->starts, 0, sizeof(unsigned long long) * words);
+  rxdfa *d = &rc->rev;
+  int st = rxStart(d, 1), i;
+  for (i = len; ; i--) //read the line backwards: the backward program accepts wherever a match starts
+  {
+    rxstate *cur = &d->states[st];
+    if (cur->accept || (i == 0 && cur->acceptend)) rc->starts[(i - from) / 64] |= 1ULL << ((i - from) % 64);
+    if (i <= from) break;
+    st = rxStep(d, st, (unsigned char)s[i - 1]);
+  }
+  rc->line = s;
+  rc->linelen = len;
+  rc->linefrom = from;
+}
+
+int regexFind(regexCache *rc, const char *s, int len, int from, int *end) //the leftmost longest match starting at or after from
+{
+  /**The line is only read backwards again when it is not the one read last, or when the match wanted lies before the part
+  *of it that was read, so the callers that step from match to match along a line read it once.
+  *end may be NULL when only where the match starts is wanted.
+  */
+  if (len == 0)
+  {
+    int e = regexMatchAt(rc, s, len, 0);
+    if (end) *end = e;
+    return e == -1 ? -1 : 0;
+  }
+  if (rc->line != s || rc->linelen != len || from < rc->linefrom) regexLineStarts(rc, s, len, from);
+  int i = from - rc->linefrom, w = i / 64, last = (len - rc->linefrom) / 64;
+  unsigned long long bits = rc->starts[w] & (~0ULL << (i % 64));
+  while (!bits)
+  {
+    if (++w > last) return -1;
+    bits = rc->starts[w];
+  }
+  int start = rc->linefrom + w * 64 + __builtin_ctzll(bits);
+  if (end) *end = regexMatchAt(rc, s, len, start);
+  return start;
+}
+
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Find *******************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+
+/**Plain text is found with Boyer-Moore-Horspool, behind an SSE2 filter that compares the first and the last byte of the
+*query against 16 positions at once and only verifies the positions where both agree. Leaves that were never built are
+*searched as one run of the file mapping, so a search through a huge file neither builds rows nor stops at every line.
+*Ctrl-R switches the prompt to regular expressions (see Regex); a literal string that every match of the pattern starts
+*with is found the same way, and the pattern is only tried where it occurs.
+*The search is incremental: every key typed in the prompt searches again, and a plain query that only grew continues from
+*the current match, since a match of the longer query is always a match of the shorter one.
+*/
+
+void searchSetQuery(const char *query) //make query the text being searched for, or stop searching when it is NULL
+{
+  free(E.search.query);
+  E.search.query = query ? strdup(query) : NULL;
+  E.search.len = query ? strlen(query) : 0;
+  regexCacheFree(E.search.rc);
+  regexFree(E.search.re);
+  E.search.re = NULL;
+  E.search.rc = NULL;
+  E.search.error = NULL;
+  E.search.lit = E.search.query;
+  E.search.litlen = E.search.len;
+  if (query && E.search.regex && E.search.len > 0)
+  {
+    E.search.re = regexCompile(query, &E.search.error);
+    E.search.lit = E.search.re ? E.search.re->prefix : NULL;
+    E.search.litlen = E.search.re ? E.search.re->prefixlen : 0;
+    if (E.search.re) E.search.rc = regexCacheNew(E.search.re);
+  }
+
+  int j;
+  for (j = 0; j < 256; j++)
+    E.search.skip[j] = E.search.litlen;
+  for (j = 0; j < E.search.litlen - 1; j++) //how far the literal can move when the byte under its last position is j
+    E.search.skip[(unsigned char)E.search.lit[j]] = E.search.litlen - 1 - j;
+}
+
+int searchActive() //whether there is a query that can match
+{
+  return E.search.len > 0 && (!E.search.regex || E.search.re);
+}
+
+const char *searchMemBMH(const char *hay, int len) //Boyer-Moore-Horspool, used where the SIMD filter does not apply
+{
+  const char *q = E.search.lit;
+  int n = E.search.litlen, pos = 0;
+  unsigned char last = q[n - 1];
+  while (pos <= len - n)
+  {
+    unsigned char c = hay[pos + n - 1];
+    if (c == last && memcmp(hay + pos, q, n - 1) == 0) return hay + pos;
+    pos += E.search.skip[c];
+  }
+  return NULL;
+}
+
+#ifdef __SSE2__
+const char *searchMemSSE2(const char *hay, int len) //compare the first and last byte of the literal at 16 positions at once
+{
+  const char *q = E.search.lit;
+  int n = E.search.litlen, pos = 0;
+  const __m128i first = _mm_set1_epi8(q[0]);
+  const __m128i last = _mm_set1_epi8(q[n - 1]);
+  for (; pos + n - 1 + 16 <= len; pos += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + pos));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + pos + n - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) //only the positions where both bytes agree are compared in full
+    {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(hay + pos + bit + 1, q + 1, n - 2) == 0) return hay + pos + bit;
+      mask &= mask - 1;
+    }
+  }
+  return searchMemBMH(hay + pos, len - pos); //the tail that is too short for a full block
+}
+#endif
+
+const char *searchMem(const char *hay, int len) //find the first occurrence of the literal in a buffer
+{
+  if (len < E.search.litlen) return NULL;
+  if (E.search.litlen == 1) return memchr(hay, E.search.lit[0], len);
+#ifdef __SSE2__
+  return searchMemSSE2(hay, len);
+#else
+  return searchMemBMH(hay, len);
+#endif
+}
 
-  erow *row = &E.row[E.cy]; //get the row that the cursor is on
-  
-  if(E.cx > 0)
+int searchTextIn(regexCache *rc, const char *s, int len, int from, int *end) //column of the first match at or after from,
+{                                                                           //-1 if there is none; *end, unless NULL, is where it ends
+  if (from > len) return -1;
+  const char *m;
+  if (!E.search.re) //plain text
+  {
+    m = searchMem(s + from, len - from);
+    if (!m) return -1;
+    if (end) *end = m - s + E.search.len;
+    return m - s;
+  }
+  if (E.search.litlen == 0) return regexFind(rc, s, len, from, end);
+  while ((m = searchMem(s + from, len - from))) //try the pattern only where its literal prefix occurs
+  {
+    int e = regexMatchAt(rc, s, len, m - s);
+    if (e != -1)
+    {
+      if (end) *end = e;
+      return m - s;
+    }
+    from = m - s + 1;
+  }
+  return -1;
+}
+
+int searchText(const char *s, int len, int from, int *end) //searchTextIn() for the main thread
+{
+  return searchTextIn(E.search.rc, s, len, from, end);
+}
+
+int searchTextLast(const char *s, int len, int before) //column of the last match that starts before 'before', -1 if there is none
+{
+  int col = -1, m, at = 0;
+  while ((m = searchText(s, len, at, NULL)) != -1 && m < before)
+  {
+    col = m;
+    at = m + 1;
+  }
+  return col;
+}
+
+int searchMappedIn(regexCache *rc, int first, int last, int col, int *line, int *end) //search the lines first to last of the
+{                                                                                      //mapping, from col of the first one
+  char *s;
+  int len;
+  if (E.search.re && E.search.litlen == 0) //nothing to skip ahead with: try the lines one at a time
+  {
+    for (; first <= last; first++, col = 0)
+    {
+      editorMappedLine(first, &s, &len);
+      int m = searchTextIn(rc, s, len, col, end);
+      if (m != -1)
+      {
+        *line = first;
+        return m;
+      }
+    }
+    return -1;
+  }
+
+  size_t start = (first ? E.lineend[first - 1] + 1 : 0) + col, stop = E.lineend[last];
+  while (start < stop) //search the whole run for the literal
+  {
+    const char *m = searchMem(E.map + start, stop - start);
+    if (!m) return -1;
+    size_t off = m - E.map;
+
+    int lo = first, hi = last; //the literal holds no line ending, so it lies in the first line that ends after it
+    while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2;
+      if (E.lineend[mid] < off) lo = mid + 1;
+      else hi = mid;
+    }
+    int mcol = off - (lo ? E.lineend[lo - 1] + 1 : 0);
+    if (!E.search.re)
+    {
+      *line = lo;
+      if (end) *end = mcol + E.search.len;
+      return mcol;
+    }
+    editorMappedLine(lo, &s, &len); //a pattern is tried from there to the end of the line
+    mcol = searchTextIn(rc, s, len, mcol, end);
+    if (mcol != -1)
+    {
+      *line = lo;
+      return mcol;
+    }
+    start = E.lineend[lo] + 1;
+    first = lo + 1;
+  }
+  return -1;
+}
+
+int searchForward(int row, int col, int endrow, int *mrow, int *mcol) //find the first match at or after (row, col), before endrow
+{
+  if (endrow > E.numrows) endrow = E.numrows; //the wrap-around bound of a search started past the last line
+  while (row < endrow)
+  {
+    int idx, j, line, end;
+    rnode *leaf = ropeDescend(row, &idx, 0, 0);
+    int n = leaf->n - idx;
+    if (n > endrow - row) n = endrow - row;
+    if (!leaf->rows && leaf->line0 >= 0)
+    {
+      int m = searchMappedIn(E.search.rc, leaf->line0 + idx, leaf->line0 + idx + n - 1, col, &line, &end);
+      if (m != -1)
+      {
+        *mrow = row + line - leaf->line0 - idx;
+        *mcol = m;
+        return 1;
+      }
+    }
+    else
+    {
+      for (j = 0; j < n; j++)
+      {
+        char *s;
+        int len;
+        ropeLineText(leaf, idx + j, &s, &len);
+        int m = searchText(s, len, j == 0 ? col : 0, &end);
+        if (m != -1)
+        {
+          *mrow = row + j;
+          *mcol = m;
+          return 1;
+        }
+      }
+    }
+    row += n;
+    col = 0;
+  }
+  return 0;
+}
+
+int searchBackward(int row, int before, int endrow, int *mrow, int *mcol) //find the last match before (row, before), down to endrow
+{
+  if (row >= E.numrows) //a search started on the empty line past the end: look from the end of the last line
+  {
+    row = E.numrows - 1;
+    before = INT_MAX;
+  }
+  for (; row >= endrow; row--)
+  {
+    char *s;
+    int len;
+    editorLineText(row, &s, &len);
+    int m = searchTextLast(s, len, before);
+    if (m != -1)
+    {
+      *mrow = row;
+      *mcol = m;
+      return 1;
+    }
+    before = INT_MAX;
+  }
+  return 0;
+}
+
+/**Besides moving to the nearest match, every query starts a scan that counts and indexes all of its matches. The rope is
+*first flattened into a list of leaves, so the threads of the scan never touch the tree or the gap of a row: rows that were
+*built have their gap closed beforehand, and leaves that were not are read straight from the mapping, which nothing
+*modifies. The main thread goes on drawing and moving between matches during the scan, and closes the gaps of the rows it
+*reads as it goes, so the threads cannot do that themselves. Only an edit opens a gap, through a row that editorRow()
+*handed out, so only the leaves marked touched by it need their gaps closed, and listing the leaves of a file that was
+*not edited costs a step per leaf. The leaves are grouped into tasks, which the threads take in order starting from the one that holds the cursor,
+*so the matches near the cursor are known first. Each task keeps its own sorted list of matches, and the tasks are in file
+*order, so together they form a sorted index of the whole file. The text cannot change while the prompt is open, and the
+*scan is cancelled and joined before the query changes or the prompt closes.
+*/
+
+void searchCollect(rnode *t) //list the leaves of the rope in order for the scan, closing the gaps of the rows of touched leaves
+{
+  if (!t) return;
+  searchCollect(t->left);
+  if (E.search.nspans == E.search.spanscap)
+  {
+    E.search.spanscap = E.search.spanscap ? E.search.spanscap * 2 : 64;
+    E.search.spans = xrealloc(E.search.spans, sizeof(searchSpan) * E.search.spanscap);
+  }
+  searchSpan *sp = &E.search.spans[E.search.nspans];
+  sp->row0 = E.search.nspans ? sp[-1].row0 + sp[-1].n : 0;
+  sp->n = t->n;
+  sp->line0 = t->line0;
+  sp->rows = t->rows;
+  if (!t->rows && t->line0 < 0) sp->rows = ropeLeafRows(t);
+  if (sp->rows && t->touched)
+  {
+    int j;
+    for (j = 0; j < t->n; j++)
+      editorRowFlat(&sp->rows[j]);
+    t->touched = 0;
+  }
+  E.search.nspans++;
+  searchCollect(t->right);
+}
+
+void searchPush(searchTask *t, int row, int col) //add a match to a task, as long as the index has room for it
+{
+  if (t->full) return;
+  if (__atomic_fetch_add(&E.search.stored, 1, __ATOMIC_RELAXED) >= KILO_SEARCH_INDEX_MAX)
+  {
+    t->full = 1;
+    return;
+  }
+  if (t->mn == t->mcap)
+  {
+    t->mcap = t->mcap ? t->mcap * 2 : 64;
+    t->m = realloc(t->m, sizeof(searchMatch) * t->mcap);
+  }
+  t->m[t->mn].row = row;
+  t->m[t->mn].col = col;
+  t->mn++;
+}
+
+long searchTaskRun(searchTask *t, regexCache *rc) //find every match in the leaves of a task, returns the number found
+{
+  long found = 0;
+  int s, j;
+  for (s = t->span0; s < t->span0 + t->nspans; s++)
+  {
+    if (__atomic_load_n(&E.search.cancel, __ATOMIC_RELAXED)) break;
+    searchSpan *sp = &E.search.spans[s];
+    if (!sp->rows) //one run of the mapping
+    {
+      int line = sp->line0, last = sp->line0 + sp->n - 1, col = 0, m;
+      while (line <= last && (m = searchMappedIn(rc, line, last, col, &line, NULL)) != -1) //where matches end is not needed
+      {
+        searchPush(t, sp->row0 + line - sp->line0, m);
+        found++;
+        col = m + 1;
+      }
+      continue;
+    }
+    for (j = 0; j < sp->n; j++)
+    {
+      erow *row = &sp->rows[j];
+      int m, at = 0;
+      while ((m = searchTextIn(rc, row->chars, row->size, at, NULL)) != -1)
+      {
+        searchPush(t, sp->row0 + j, m);
+        found++;
+        at = m + 1;
+      }
+    }
+  }
+  return found;
+}
+
+void *searchWorker(void *arg) //a thread of the scan: take tasks until there are none left or the scan is cancelled
+{
+  (void)arg;
+  int k;
+  regexCache *rc = E.search.re ? regexCacheNew(E.search.re) : NULL; //the DFAs are built as the thread goes, so it needs its own
+  while (!__atomic_load_n(&E.search.cancel, __ATOMIC_RELAXED) &&
+         (k = __atomic_fetch_add(&E.search.next, 1, __ATOMIC_RELAXED)) < E.search.ntasks)
+  {
+    searchTask *t = &E.search.tasks[(E.search.first + k) % E.search.ntasks];
+    long found = searchTaskRun(t, rc);
+    if (__atomic_load_n(&E.search.cancel, __ATOMIC_RELAXED)) break;
+    __atomic_add_fetch(&E.search.count, found, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&E.search.finished, 1, __ATOMIC_RELEASE);
+    editorWake(); //the message bar has a new count to show
+  }
+  regexCacheFree(rc);
+  return NULL;
+}
+
+void searchScanStop() //cancel the scan, wait for its threads and drop its index
+{
+  int j;
+  __atomic_store_n(&E.search.cancel, 1, __ATOMIC_RELAXED);
+  for (j = 0; j < E.search.nthreads; j++)
+    pthread_join(E.search.threads[j], NULL);
+  for (j = 0; j < E.search.ntasks; j++)
+    free(E.search.tasks[j].m);
+  free(E.search.tasks);
+  free(E.search.spans);
+  E.search.tasks = NULL;
+  E.search.spans = NULL;
+  E.search.ntasks = E.search.nspans = E.search.spanscap = E.search.nthreads = E.search.first = 0;
+  E.search.next = E.search.finished = E.search.stored = E.search.cancel = 0;
+  E.search.count = 0;
+  E.search.shown = -1;
+}
+
+void searchScanStart() //count and index every match of the query on a pool of threads
+{
+  if (!searchActive() || E.numrows == 0) return;
+
+  searchCollect(E.rope);
+
+  E.search.tasks = xcalloc(E.search.nspans, sizeof(searchTask)); //group the leaves into tasks of about the same number of rows
+  int s = 0;
+  while (s < E.search.nspans)
+  {
+    searchTask *t = &E.search.tasks[E.search.ntasks++];
+    int rows = 0;
+    t->span0 = s;
+    while (s < E.search.nspans && rows < KILO_SEARCH_TASK_ROWS)
+      rows += E.search.spans[s++].n;
+    t->nspans = s - t->span0;
+    if (E.search.spans[t->span0].row0 <= E.search.cy) E.search.first = E.search.ntasks - 1;
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int want = cpus < 1 ? 1 : cpus > KILO_SEARCH_THREADS ? KILO_SEARCH_THREADS : cpus;
+  if (want > E.search.ntasks) want = E.search.ntasks;
+
+  sigset_t all, old; //the threads inherit a mask that leaves signals such as SIGWINCH to the main thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  while (E.search.nthreads < want && pthread_create(&E.search.threads[E.search.nthreads], NULL, searchWorker, NULL) == 0)
+    E.search.nthreads++;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (E.search.nthreads == 0) searchWorker(NULL); //no threads to be had: scan in place
+}
+
+int searchScanIndexed() //whether the scan has finished and kept every match in its index
+{
+  if (E.search.ntasks == 0 || __atomic_load_n(&E.search.finished, __ATOMIC_ACQUIRE) != E.search.ntasks) return 0;
+  return E.search.stored <= KILO_SEARCH_INDEX_MAX;
+}
+
+int searchScanProgress() //whether the match count shown in the message bar is out of date
+{
+  if (E.search.ntasks == 0) return 0;
+  return __atomic_load_n(&E.search.count, __ATOMIC_RELAXED) != E.search.shown ||
+         __atomic_load_n(&E.search.finished, __ATOMIC_RELAXED) != E.search.shownfinished;
+}
+
+int searchIndexTask(int row) //the task that holds a row
+{
+  int lo = 0, hi = E.search.ntasks - 1;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (E.search.spans[E.search.tasks[mid].span0].row0 <= row) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+int searchIndexRank(int row, int col) //number of indexed matches that come before (row, col)
+{
+  int k = searchIndexTask(row), rank = 0, j;
+  for (j = 0; j < k; j++)
+    rank += E.search.tasks[j].mn;
+  searchTask *t = &E.search.tasks[k];
+  int lo = 0, hi = t->mn;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (t->m[mid].row < row || (t->m[mid].row == row && t->m[mid].col < col)) lo = mid + 1;
+    else hi = mid;
+  }
+  return rank + lo;
+}
+
+int searchIndexStep(int row, int col, int dir, int *mrow, int *mcol) //the next (dir 1) or previous (dir -1) match in the index
+{
+  if (E.search.stored == 0) return 0;
+  int rank = searchIndexRank(row, col + (dir == 1 ? 1 : 0)) - (dir == 1 ? 0 : 1); //rank of the match wanted
+  int total = E.search.stored;
+  rank = (rank + total) % total; //wrap around the ends of the file
+
+  int k = 0;
+  while (rank >= E.search.tasks[k].mn)
+    rank -= E.search.tasks[k++].mn;
+  *mrow = E.search.tasks[k].m[rank].row;
+  *mcol = E.search.tasks[k].m[rank].col;
+  return 1;
+}
+
+void editorFindReveal(int row, int col) //move the cursor to a match, centering it on the screen if it is not visible
+{
+  E.cy = row;
+  E.cx = col;
+  if (row < E.rowoff || row >= E.rowoff + E.screenrows)
+  {
+    E.rowoff = row - E.screenrows / 2;
+    if (E.rowoff < 0) E.rowoff = 0;
+  }
+}
+
+void editorFindPrompt() //set the search prompt, which tells whether the query is plain text or a regular expression
+{
+  snprintf(E.search.prompt, sizeof(E.search.prompt), "%s: %%s (Use ESC/Arrows/Enter, Ctrl-R for %s)",
+           E.search.regex ? "Regex" : "Search", E.search.regex ? "text" : "regex");
+}
+
+void editorFindCallback(char *query, int key) //called by editorPrompt after every key typed into the search prompt
+{
+  if (key == CTRL_KEY('r')) //switch between plain text and regular expressions, then search again
+  {
+    E.search.regex = !E.search.regex;
+    editorFindPrompt();
+    searchScanStop();
+    searchSetQuery(NULL);
+  }
+  if (key == '\r' || key == '\x1b' || E.numrows == 0) return;
+
+  int dir = 0, row, col, found;
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) dir = 1;
+  else if (key == ARROW_LEFT || key == ARROW_UP) dir = -1;
+
+  if (dir == 0) //the query changed
   {
-    editorRowDelChar(row, E.cx - 1); 
-    E.cx--; //move the cursor to the left
+    int qlen = strlen(query);
+    int grown = !E.search.regex && E.search.query && E.search.row != -1 && qlen > E.search.len &&
+                strncmp(query, E.search.query, E.search.len) == 0;
+    searchScanStop(); //the scan of the old query is of no use anymore
+    searchSetQuery(query);
+    if (!searchActive()) //nothing to look for: go back to where the search started
+    {
+      E.search.row = -1;
+      E.cx = E.search.cx;
+      E.cy = E.search.cy;
+      E.rowoff = E.search.rowoff;
+      return;
+    }
+    row = grown ? E.search.row : E.search.cy; //a longer plain query can only match at or after the current match
+    col = grown ? E.search.col : E.search.cx;
+    found = searchForward(row, col, E.numrows, &row, &col) || searchForward(0, 0, row + 1, &row, &col);
+    searchScanStart(); //count the rest in the background
   }
   else
   {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;    
-  } 
+    if (!searchActive()) return;
+    row = E.search.row != -1 ? E.search.row : E.cy;
+    col = E.search.row != -1 ? E.search.col : E.cx;
+    if (E.search.row != -1 && searchScanIndexed()) //the index knows every match
+      found = searchIndexStep(row, col, dir, &row, &col);
+    else if (dir == 1) //next match, wrapping around to the top of the file
+      found = searchForward(row, col + 1, E.numrows, &row, &col) || searchForward(0, 0, row + 1, &row, &col);
+    else //previous match, wrapping around to the bottom of the file
+      found = searchBackward(row, col, 0, &row, &col) || searchBackward(E.numrows - 1, INT_MAX, row, &row, &col);
+  }
+
+  if (!found)
+  {
+    E.search.row = -1;
+    return;
+  }
+  E.search.row = row;
+  E.search.col = col;
+  editorFindReveal(row, col);
 }
 
+void editorFind() //search for a query in the file, moving to the matches while the query is typed
+{
+  E.search.cx = E.cx;
+  E.search.cy = E.cy;
+  E.search.rowoff = E.rowoff;
+  E.search.coloff = E.coloff;
+  E.search.row = -1;
+
+  editorFindPrompt();
+  char *query = editorPrompt(E.search.prompt, editorFindCallback);
+  
+  if(query == NULL) //cancelled: put the view back where it was
+  {
+    E.cx = E.search.cx;
+    E.cy = E.search.cy;
+    E.rowoff = E.search.rowoff;
+    E.coloff = E.search.coloff;
+  }
+  free(query);
+  searchScanStop();
+  searchSetQuery(NULL); //stop highlighting the matches
+}
+//
 /*-------------------------------------------------------------------------------------------------------------------------------*/
-/******************************************************** File I/O ***************************************************************/
+/******************************************************** Append Buffer **********************************************************/
 /*-------------------------------------------------------------------------------------------------------------------------------*/
+//better to do one big write(), to make sure the whole screen updates at once.
+// We want to replace all our write() calls with code that appends the string to a buffer, and then write() this buffer out at the end.
+// The buffers used for frames live as long as the editor and are only reset between frames, so once they have grown to the size
+// of a frame, drawing does not allocate at all.
 
-char *editorRowsToString(int *buflen)      //convert the rows of the file into a single string.
+int abReserve(struct abuf *ab, int len) //make room for len more bytes, growing the buffer geometrically
 {
-  int totlen = 0;
-  int j;
-  for(j = 0; j < E.numrows; j++) //loop through the rows of the file and add up their sizes
-    totlen += E.row[j].size + 1;
-  *buflen = totlen; //set buflen to the total size of the file
-  char *buf = malloc(totlen); //allocate a buffer of that size
-  char *p = buf;
-  for(j = 0; j < E.numrows; j++) //loop through the rows of the file again, and copy their contents into the buffer
+  if (ab->len + len <= ab->cap) return 0;
+  int cap = ab->cap ? ab->cap * 2 : 256;
+  while (cap < ab->len + len) cap *= 2;
+  char *new = xrealloc(ab->b, cap);
+  if (new == NULL) return -1;
+  ab->b = new;
+  ab->cap = cap;
+  return 0;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) //append a string to an abuf struct 
+{
+  if (len <= 0 || abReserve(ab, len) == -1) return;
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+void abAppendFill(struct abuf *ab, char c, int len) //append a run of len copies of one character, such as padding spaces
+{
+  if (len <= 0 || abReserve(ab, len) == -1) return;
+  memset(&ab->b[ab->len], c, len);
+  ab->len += len;
+}
+
+void abFree(struct abuf *ab) //free the memory used by an abuf struct
+{
+  free(ab->b);
+  ab->b = NULL;
+  ab->len = 0;
+  ab->cap = 0;
+}
+
+int editorWriteAll(int fd, const char *buf, int len) //write a whole buffer, carrying on after short writes and interruptions
+{
+  while (len > 0)
   {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+    ssize_t n = write(fd, buf, len);
+    if (n == -1)
+    {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
   }
-  return buf;
+  return 0;
 }
 
-void editorOpen(char *filename) //open a file and load its contents into the editor
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Output *****************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+
+void editorScroll() //scroll the screen to keep the cursor visible on the screen
 {
-  free(E.filename);
-  E.filename = strdup(filename);
+  E.rx = 0;
+  if (E.cy < E.numrows) //if the cursor is above the last row, set rx to the render index of the cursor
+  {
+    E.rx = editorRowCxToRx(editorRow(E.cy), E.cx);
+  }
+
+  if (E.cy < E.rowoff) //checks if the cursor is above the visible window, and if so, scrolls up to where the cursor is
+  {
+    E.rowoff = E.cy;
+  }
+  if (E.cy >= E.rowoff + E.screenrows) //checks if the cursor is past the bottom of the visible window
+  {
+    E.rowoff = E.cy - E.screenrows + 1;
+  }
+  if (E.rx < E.coloff) //checks if the cursor is to the left of the visible window
+  {
+    E.coloff = E.rx;
+  }
+  if (E.rx >= E.coloff + E.screencols) //checks if the cursor is to the right of the visible window
+  {
+    E.coloff = E.rx - E.screencols + 1;
+  }
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+void editorDrawSource(struct abuf *src, int cx, int n, int step) //the next n bytes drawn come from index cx on, step characters apart
+{
+  if (!src || n <= 0 || abReserve(src, n * sizeof(int)) == -1) return;
+  int *s = (int *)(src->b + src->len), j;
+  for (j = 0; j < n; j++)
+    s[j] = cx + j * step;
+  src->len += n * sizeof(int);
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1)
+void editorDrawChars(struct abuf *ab, struct abuf *src, erow *row, int from, int len) //draw the columns [from, from + len) of a row one character at a time
+{
+  /**Starts at the character on column from, found with the column index, so the cost is in proportion to what is
+  *drawn. Tabs become spaces, and so does any part of a wide character that is cut by the edge of the screen. src, when
+  *given, gets the index of the character every byte drawn comes from, which is how highlights are laid out.
+  */
+  int cx = 0, rx = 0, end = from + len;
+  if (from) //a row drawn from its start, as most are, needs no lookup
   {
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    
-    editorInsertRow(E.numrows, line, linelen);
+    cx = editorRowRxtoCx(row, from);
+    rx = editorRowCxToRx(row, cx);
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0; //reset the dirty flag
+  while (cx < row->size && rx < end)
+  {
+    const char *s = &row->chars[cx < row->gap ? cx : cx + row->gaplen];
+    int run = 0, most = (cx < row->gap ? row->gap : row->size) - cx; //a run of plain ASCII goes in one copy, up to the gap
+    if (most > end - rx) most = end - rx;
+    while (run < most && s[run] != '\t' && (unsigned char)s[run] < 0x80) run++;
+    if (run)
+    {
+      abAppend(ab, s, run);
+      editorDrawSource(src, cx, run, 1);
+      cx += run;
+      rx += run;
+      continue;
+    }
+    int w, clen = editorWideSpan(row, cx, rx, &w);
+    if (editorRowCharAt(row, cx) == '\t' || rx < from || rx + w > end)
+    {
+      int first = rx < from ? from : rx, last = rx + w > end ? end : rx + w;
+      abAppendFill(ab, ' ', last - first);
+      editorDrawSource(src, cx, last - first, 0);
+    }
+    else
+    {
+      int j;
+      for (j = 0; j < clen; j++)
+      {
+        char c = editorRowCharAt(row, cx + j);
+        abAppend(ab, &c, 1);
+      }
+      editorDrawSource(src, cx, clen, 0);
+    }
+    cx += clen;
+    rx += w;
+  }
+}
+
+void editorDrawRow(struct abuf *ab, erow *row, int from, int len) //draw the render columns [from, from + len) of a row
+{
+  if (editorRowUtf8(row) || (row->tabs && row->size >= KILO_LONG_LINE)) //columns are not bytes, or the render would be huge
+  {
+    editorDrawChars(ab, NULL, row, from, len);
+    return;
+  }
+  if (row->tabs == 0) //the render field is the text: copy the two halves around the gap without closing it
+  {
+    if (from > row->size) from = row->size;
+    if (len > row->size - from) len = row->size - from;
+    int head = row->gap - from; //part of the span that lies before the gap
+    if (head > len) head = len;
+    if (head > 0) abAppend(ab, &row->chars[from], head);
+    else head = 0;
+    if (len > head) abAppend(ab, &row->chars[from + head + row->gaplen], len - head);
+    return;
+  }
+  char *render = editorRowRender(row);
+  if (from > row->rsize) from = row->rsize;
+  if (len > row->rsize - from) len = row->rsize - from;
+  abAppend(ab, &render[from], len);
+}
+
+void editorDrawHighlight(struct abuf *ab, int hl) //switch the terminal to the colors of a highlight class
+{
+  if (hl == HL_NORMAL)
+  {
+    abAppend(ab, "\x1b[m", 3);
+    return;
+  }
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[0;%d%sm", editorSyntaxToColor(hl & ~(HL_MATCH | HL_CURRENT)),
+    hl & HL_CURRENT ? ";1;4;7" : hl & HL_MATCH ? ";7" : ""); //matches are inverted, the current one also bold and underlined
+  abAppend(ab, buf, len);
 }
 
-void editorSave() //save the contents of the editor to disk
+void editorDrawHighlighted(struct abuf *ab, erow *row, int from, int len) //draw a row with its syntax and the search matches highlighted
 {
-  if(E.filename == NULL)
+  /**Every screen column gets a class: the class of the character drawn there, plus HL_MATCH or HL_CURRENT when a search
+  *match covers it. An escape sequence is only sent where the class changes, so a run in one color costs one sequence.
+  */
+  struct abuf *plain = &E.hlbuf, *cols = &E.hlcols, *src = &E.hlsrc;
+  plain->len = src->len = 0;
+  int utf8 = editorRowUtf8(row) || row->size >= KILO_LONG_LINE; //every byte drawn is traced back to its character
+  if (utf8) editorDrawChars(plain, src, row, from, len);
+  else editorDrawRow(plain, row, from, len);
+  int *source = (int *)src->b;
+  cols->len = 0;
+  abAppendFill(cols, HL_NORMAL, plain->len);
+  unsigned char *hl = (unsigned char *)cols->b;
+
+  if (E.syntax && row->hl && row->hlversion == row->version && plain->len > 0)
   {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel) ");
-    if(E.filename == NULL)
+    int j;
+    if (utf8) //every byte takes the class of its character
     {
-      editorSetStatusMessage("Save aborted");
-      return;
+      int first = source[0]; //a long row only has the classes around the screen at hand
+      unsigned char *classes = row->longhl ? editorSyntaxWindow(row, first, source[plain->len - 1] + 1) : &row->hl[first];
+      for (j = 0; j < plain->len; j++)
+        hl[j] = classes[source[j] - first];
+    }
+    else if (row->tabs == 0) //one column per character
+    {
+      memcpy(hl, &row->hl[from], plain->len);
+    }
+    else //a tab spreads its class over every column it takes
+    {
+      int rx;
+      j = editorRowRxtoCx(row, from);
+      rx = editorRowCxToRx(row, j); //start at the character drawn in the first column
+      for (; j < row->size && rx < from + plain->len; j++)
+      {
+        int w = editorRowCharAt(row, j) == '\t' ? KILO_TAB_STOP - rx % KILO_TAB_STOP : 1;
+        for (; w > 0; w--, rx++)
+          if (rx >= from && rx < from + plain->len) hl[rx - from] = row->hl[j];
+      }
     }
   }
 
-  int len;
-  char *buf = editorRowsToString(&len); //convert the rows of the file into a single string
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644); //open the file for writing -> 0644 is the permission mode -> O_RDWR is read/write mode -> O_CREAT is create the file if it doesn't exist.
-  if(fd != -1)
+  if (searchActive() && plain->len > 0)
   {
-    if(ftruncate(fd, len) != -1)
+    char *s = editorRowFlat(row);
+    int at = 0, len = row->size, m, end, b = 0;
+    if (row->size >= KILO_LONG_LINE) //search a long row around the screen only, matches longer than a chunk are not shown
     {
-      if(write(fd, buf, len) == len)
+      at = source[0] > KILO_LONG_CHUNK ? source[0] - KILO_LONG_CHUNK : 0;
+      if (len - source[plain->len - 1] > KILO_LONG_CHUNK) len = source[plain->len - 1] + KILO_LONG_CHUNK;
+    }
+    while ((m = searchText(s, len, at, &end)) != -1)
+    {
+      at = end > m ? end : m + 1;
+      if (end == m || (end == len && len < row->size)) continue; //an empty match has nothing to highlight
+      int flag = row == editorRow(E.search.row) && m == E.search.col ? HL_CURRENT : HL_MATCH;
+      if (utf8) //matches and the bytes drawn both go left to right
       {
-        close(fd);
-        free(buf);
-        E.dirty = 0; //reset the dirty flag
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
+        while (b < plain->len && source[b] < m) b++;
+        if (b == plain->len) break;
+        for (; b < plain->len && source[b] < end; b++)
+          hl[b] |= flag;
+        continue;
       }
+      int rx0 = editorRowCxToRx(row, m) - from, rx1 = editorRowCxToRx(row, end) - from;
+      if (rx1 <= 0) continue;
+      if (rx0 >= plain->len) break;
+      if (rx0 < 0) rx0 = 0;
+      if (rx1 > plain->len) rx1 = plain->len;
+      for (; rx0 < rx1; rx0++)
+        hl[rx0] |= flag;
     }
-    close(fd);
   }
-  free(buf); //free the buffer 
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno)); //set the status message to an error message
-
-}
-
-
-/*-------------------------------------------------------------------------------------------------------------------------------*/
-/******************************************************** Find *******************************************************************/
-/*-------------------------------------------------------------------------------------------------------------------------------*/
-
-void editorFind() //search for a query in the file
-{
-  char *query = editorPrompt("Search: %s (ESC to Cancel) ");
-  
-  if(query == NULL) return;
 
-  int i;
-  for(i = 0; i <E.numrows; i++)//loop through the rows of the file
+  int pos = 0, cur = HL_NORMAL;
+  while (pos < plain->len)
   {
-    erow *row = &E.row[i]; //get the row that the cursor is on
-    char *match = strstr(row->render, query); //strstr() is a standard library function that finds the first occurrence of one string in another string.
-    
-    if(match) //if the query is found in the row
+    int run = pos + 1;
+    while (run < plain->len && hl[run] == hl[pos]) run++;
+    if (hl[pos] != cur)
     {
-      E.cy = i; //set the cursor to the row that contains the match
-      E.cx = editorRowRxtoCx(row, match - row->render); //set the cursor to the column that contains the match
-      E.rowoff = E.numrows; //scroll the screen to the bottom of the file
-      break;
+      cur = hl[pos];
+      editorDrawHighlight(ab, cur);
     }
+    abAppend(ab, plain->b + pos, run - pos);
+    pos = run;
   }
-  free(query);
+  if (cur != HL_NORMAL) abAppend(ab, "\x1b[m", 3);
 }
-//
-/*-------------------------------------------------------------------------------------------------------------------------------*/
-/******************************************************** Append Buffer **********************************************************/
-/*-------------------------------------------------------------------------------------------------------------------------------*/
-//better to do one big write(), to make sure the whole screen updates at once.
-// We want to replace all our write() calls with code that appends the string to a buffer, and then write() this buffer out at the end.
 
-void abAppend(struct abuf *ab, const char *s, int len) //append a string to an abuf struct 
+int editorScreenPlain(struct abuf *line) //whether every byte of a screen line is a printable ASCII character taking one column
 {
-  char *new = realloc(ab->b, ab->len + len);
-
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+  int j;
+  for (j = 0; j < line->len; j++)
+    if (line->b[j] < ' ' || line->b[j] > '~') return 0;
+  return 1;
 }
 
-void abFree(struct abuf *ab) //free the memory used by an abuf struct
+void editorScreenInvalidate() //forget what is on the terminal, so that the next frame repaints every line
 {
-  free(ab->b);
+  int y;
+  for (y = 0; y < E.screenlines; y++)
+    abFree(&E.screen[y]);
+  E.screenlines = E.screenrows + 2;
+  E.screen = xrealloc(E.screen, sizeof(struct abuf) * E.screenlines);
+  for (y = 0; y < E.screenlines; y++)
+  {
+    E.screen[y].b = NULL;
+    E.screen[y].len = -1;
+    E.screen[y].cap = 0;
+  }
+  E.fullredraw = 1;
 }
 
-/*-------------------------------------------------------------------------------------------------------------------------------*/
-/******************************************************** Output *****************************************************************/
-/*-------------------------------------------------------------------------------------------------------------------------------*/
-
-void editorScroll() //scroll the screen to keep the cursor visible on the screen
+int editorScreenPut(struct abuf *ab, int y, struct abuf *line) //append to the frame only what changed in a screen line since the last frame
 {
-  E.rx = 0;
-  if (E.cy < E.numrows) //if the cursor is above the last row, set rx to the render index of the cursor
+  /**The line is compared with what was sent last time. An unchanged line costs nothing. For plain text lines only the
+  *span between the first and the last differing column is sent, followed by a clear to the end of the line when the
+  *line got shorter. Lines with escape sequences in them, like the status bar, are sent whole when they change.
+  *The line buffer and the old copy trade places, and the line buffer is left empty. Returns 1 if anything was appended.
+  */
+  struct abuf *old = &E.screen[y];
+  if (old->len == line->len && (line->len == 0 || memcmp(old->b, line->b, line->len) == 0))
   {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    line->len = 0;
+    return 0;
   }
 
-  if (E.cy < E.rowoff) //checks if the cursor is above the visible window, and if so, scrolls up to where the cursor is
-  {
-    E.rowoff = E.cy;
-  }
-  if (E.cy >= E.rowoff + E.screenrows) //checks if the cursor is past the bottom of the visible window
-  {
-    E.rowoff = E.cy - E.screenrows + 1;
-  }
-  if (E.rx < E.coloff) //checks if the cursor is to the left of the visible window
-  {
-    E.coloff = E.rx;
-  }
-  if (E.rx >= E.coloff + E.screencols) //checks if the cursor is to the right of the visible window
+  int from = 0, to = line->len;
+  if (old->len >= 0 && editorScreenPlain(old) && editorScreenPlain(line))
   {
-    E.coloff = E.rx - E.screencols + 1;
+    while (from < old->len && from < line->len && old->b[from] == line->b[from]) from++;
+    if (old->len == line->len)
+      while (to > from && old->b[to - 1] == line->b[to - 1]) to--;
   }
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, from + 1);
+  abAppend(ab, buf, len);
+  abAppend(ab, &line->b[from], to - from);
+  if (old->len < 0 || line->len < old->len || !editorScreenPlain(line)) abAppend(ab, "\x1b[K", 3);
+
+  struct abuf swap = *old;
+  *old = *line;
+  *line = swap;
+  line->len = 0;
+  return 1;
 }
 
-void editorDrawRows(struct abuf *ab) //draw the rows of the file to the screen 
+int editorDrawRows(struct abuf *ab) //draw the rows of the file that changed to the screen, returns the number of lines sent
 {
-  int y;
+  int y, sent = 0;
+  if (E.syntax) editorSyntaxUpdate(E.rowoff, E.rowoff + E.screenrows < E.numrows ? E.rowoff + E.screenrows : E.numrows);
   for (y = 0; y < E.screenrows; y++) {
+    struct abuf *line = &E.linebuf; //each screen line is composed on its own, then diffed against the last frame
     int filerow = y + E.rowoff;
     if (filerow >= E.numrows) 
     {
@@ -585,83 +5738,157 @@ void editorDrawRows(struct abuf *ab) //draw the rows of the file to the screen
           int padding = (E.screencols - welcomelen) / 2;
         if (padding) 
         {
-          abAppend(ab, "~", 1);
+          abAppend(line, "~", 1);
           padding--;
         }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        abAppendFill(line, ' ', padding);
+        abAppend(line, welcome, welcomelen);
       } 
       else 
       {
-        abAppend(ab, "~", 1);
+        abAppend(line, "~", 1);
       }
     } 
     else 
     {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0) len = 0;
-      if (len > E.screencols) len = E.screencols;
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
+      if (E.syntax || searchActive())
+        editorDrawHighlighted(line, editorRow(filerow), E.coloff, E.screencols);
+      else
+        editorDrawRow(line, editorRow(filerow), E.coloff, E.screencols);
     }
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    sent += editorScreenPut(ab, y, line);
   }
+  return sent;
 }
 
-void editorDrawStatusBar(struct abuf *ab) //draw the status bar at the bottom of the screen 
+int editorDrawStatusBar(struct abuf *ab) //draw the status bar at the bottom of the screen if it changed
 {
-  abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No File Name]", E.numrows, E.dirty ? "(modified)" : ""); //print the filename and the number of lines in the status bar
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows); //print the current line number and the total number of lines in the status bar
+  struct abuf *line = &E.linebuf;
+  abAppend(line, "\x1b[7m", 4);
+  char status[160], rstatus[80];
+  int len;
+  if (E.stats.overlay) //Ctrl-P swaps the file name for the stats or the memory report
+    len = statOverlay(status, sizeof(status));
+  else
+    len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s", E.filename ? E.filename : "[No File Name]", E.numrows, E.dirty ? "(modified) " : "", E.follow.on ? "(following)" : ""); //print the filename and the number of lines in the status bar
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows); //print the file type, the current line number and the total number of lines in the status bar
   if (len > E.screencols) len = E.screencols; //truncate the status bar message if it is too long to fit on the screen
-  abAppend(ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) 
-    {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } 
-    else 
-    {
-      abAppend(ab, " ", 1);
-      len++;
-    }
+  abAppend(line, status, len);
+  if (E.screencols - len >= rlen) //right-align the line number if it fits, pad with spaces otherwise
+  {
+    abAppendFill(line, ' ', E.screencols - len - rlen);
+    abAppend(line, rstatus, rlen);
+  }
+  else
+  {
+    abAppendFill(line, ' ', E.screencols - len);
   }
-  abAppend(ab, "\x1b[m", 3); //turn off the inverted colors
-  abAppend(ab, "\r\n", 2); //move the cursor to the next line
+  abAppend(line, "\x1b[m", 3); //turn off the inverted colors
+  return editorScreenPut(ab, E.screenrows, line);
 }
 
-void editorDrawMessageBar(struct abuf *ab) //draw the message bar at the bottom of the screen 
+int editorDrawMessageBar(struct abuf *ab) //draw the message bar at the bottom of the screen if it changed
 {
-  abAppend(ab, "\x1b[K", 3);
+  struct abuf *line = &E.linebuf;
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols; //  truncate the message if it is too long to fit on the screen
   if (msglen && time(NULL) - E.statusmsg_time < 5) //display the message if it is less than 5 seconds old
-    abAppend(ab, E.statusmsg, msglen);
+    abAppend(line, E.statusmsg, msglen);
+  if (E.search.error || E.search.ntasks) //while searching, the match count goes at the right end of the bar
+  {
+    char count[64];
+    int countlen;
+    E.search.shown = __atomic_load_n(&E.search.count, __ATOMIC_RELAXED);
+    E.search.shownfinished = __atomic_load_n(&E.search.finished, __ATOMIC_RELAXED);
+    if (E.search.error)
+      countlen = snprintf(count, sizeof(count), "bad regex: %s", E.search.error);
+    else if (E.search.shownfinished < E.search.ntasks)
+      countlen = snprintf(count, sizeof(count), "%ld matches...", E.search.shown);
+    else if (E.search.row != -1 && searchScanIndexed())
+      countlen = snprintf(count, sizeof(count), "%d of %ld", searchIndexRank(E.search.row, E.search.col) + 1, E.search.shown);
+    else
+      countlen = snprintf(count, sizeof(count), "%ld matches", E.search.shown);
+    if (line->len + 1 + countlen <= E.screencols)
+    {
+      abAppendFill(line, ' ', E.screencols - line->len - countlen);
+      abAppend(line, count, countlen);
+    }
+  }
+  return editorScreenPut(ab, E.screenrows + 1, line);
+}
+
+int editorFrameUnchanged() //whether nothing that is on the screen changed since the last frame
+{
+  struct frameState *s = &E.shown;
+  return s->cx == E.cx && s->cy == E.cy && s->rowoff == E.rowoff && s->coloff == E.coloff &&
+         s->dirty == (E.dirty != 0) && s->msgshown == (time(NULL) - E.statusmsg_time < 5) &&
+         s->searchrow == E.search.row && s->searchcol == E.search.col && s->changes == E.changes && !searchScanProgress() &&
+         !E.stats.overlay; //the stats change with every frame
+}
+
+void editorFrameRecord() //remember the state a frame was drawn from
+{
+  struct frameState *s = &E.shown;
+  s->cx = E.cx;
+  s->cy = E.cy;
+  s->rowoff = E.rowoff;
+  s->coloff = E.coloff;
+  s->dirty = E.dirty != 0;
+  s->msgshown = time(NULL) - E.statusmsg_time < 5;
+  s->searchrow = E.search.row;
+  s->searchcol = E.search.col;
+  s->changes = E.changes;
 }
 
-void editorRefreshScreen() //refresh the screen and draw the rows of the file
+void editorRefreshScreen() //refresh the screen, sending only the lines that changed since the last frame
 {
+  if (E.resized) //the window changed size: start over with a full repaint
+  {
+    E.resized = 0;
+    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    E.screenrows -= 2;
+    editorScreenInvalidate();
+  }
+  statEditDone(); //a key handled inside a prompt ends where the prompt draws
+  if (!E.fullredraw && editorFrameUnchanged()) return; //the frame would be the same as the last one: skip composing it
+  long long start = benchNanos();
   editorScroll();
+  long long scrolled = benchNanos();
+  statRecord(STAT_SCROLL, scrolled - start);
 
-  struct abuf ab = ABUF_INIT;
+  struct abuf *ab = &E.frame;
+  ab->len = 0;
+
+  abAppend(ab, "\x1b[?25l", 6);
+  if (E.fullredraw) abAppend(ab, "\x1b[2J", 4);
+  E.fullredraw = 0;
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+  int sent = editorDrawRows(ab);
+  statRecord(STAT_DRAW, benchNanos() - scrolled);
+  sent += editorDrawStatusBar(ab);
+  sent += editorDrawMessageBar(ab);
+  editorFrameRecord();
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  int cy = (E.cy - E.rowoff) + 1, cx = (E.rx - E.coloff) + 1;
+  if (sent == 0 && cy == E.lastcy && cx == E.lastcx) return; //nothing changed on the screen, there is nothing to send
+  E.lastcy = cy;
+  E.lastcx = cx;
 
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);
+  abAppend(ab, buf, len);
 
-  abAppend(&ab, "\x1b[?25h", 6);
+  abAppend(ab, "\x1b[?25h", 6);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  start = benchNanos();
+  if (editorWriteAll(E.outfd, ab->b, ab->len) == -1) die("write");
+  statRecord(STAT_WRITE, benchNanos() - start);
+  statRecord(STAT_BYTES, ab->len);
+  unsigned long allocs = E.stats.allocs;
+  statRecord(STAT_ALLOCS, allocs - E.stats.allocsshown);
+  E.stats.allocsshown = allocs;
+  E.stats.written += ab->len;
+  E.stats.frames++;
 }
 
 void editorSetStatusMessage(const char *fmt, ...) //set the status message
@@ -671,6 +5898,7 @@ void editorSetStatusMessage(const char *fmt, ...) //set the status message
   vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap); //vsnprintf is the verson of snprintf that takes a va_list
   va_end(ap); //va_end cleans up the va_list
   E.statusmsg_time = time(NULL); //set the status message time to the current time
+  E.changes++;
 } 
 
 
@@ -678,10 +5906,10 @@ void editorSetStatusMessage(const char *fmt, ...) //set the status message
 /******************************************************** Input ******************************************************************/
 /*-------------------------------------------------------------------------------------------------------------------------------*/
 
-char *editorPrompt(char *prompt) //display a prompt and read a response from the user.
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) //display a prompt and read a response from the user, calling callback after every key
 {
   size_t bufsize = 128;
-  char *buf = malloc(bufsize);
+  char *buf = xmalloc(bufsize);
 
   size_t buflen = 0;
   buf[0] = '\0';
@@ -689,17 +5917,20 @@ char *editorPrompt(char *prompt) //display a prompt and read a response from the
   while(1)
   {
     editorSetStatusMessage(prompt, buf); //display the prompt and the contents of the buffer
-    editorRefreshScreen(); //refresh the screen
+    if (!editorKeyPending()) editorRefreshScreen(); //keys that came in together are handled before the screen is redrawn
 
     int c = editorReadKey(); //read a keypress
-    
+    if (c == FOLLOW) continue; //the followed file is read once the prompt is done, the search threads may be reading the rows
+
     if(c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
     {
-      if(buflen != 0) buf[--buflen] = '\0'; //if the buffer is not empty, remove the last character
+      while (buflen != 0 && ((unsigned char)buf[--buflen] & 0xC0) == 0x80); //remove the last character, with all of its UTF-8 bytes
+      buf[buflen] = '\0';
     }
     else if(c == '\x1b')
     {
       editorSetStatusMessage("");
+      if (callback) callback(buf, c);
       free(buf);
       return NULL;
     }
@@ -708,35 +5939,54 @@ char *editorPrompt(char *prompt) //display a prompt and read a response from the
       if(buflen != 0)
       {
         editorSetStatusMessage(""); //clear the status message
+        if (callback) callback(buf, c);
         return buf;
       }
     }
-    else if (!iscntrl(c) && c < 128) //if it is a printable character, append it to the buffer
+    else if (c < 256 && !iscntrl(c)) //if it is a printable character or a byte of a UTF-8 one, append it to the buffer
     {
       if(buflen == bufsize - 1) //if the buffer is full, double its size
       {
         bufsize *= 2;
-        buf = realloc(buf, bufsize);
+        buf = xrealloc(buf, bufsize);
       }
       buf[buflen++] = c; //append the character to the buffer
       buf[buflen] = '\0';
     }
+    else if (c == PASTE) //take the printable characters of the first line of a paste
+    {
+      struct editorInput *in = &E.input;
+      int j;
+      for (j = in->pastefrom; j < in->pasteto && in->paste.b[j] != '\r' && in->paste.b[j] != '\n'; j++)
+      {
+        if (iscntrl((unsigned char)in->paste.b[j])) continue;
+        if (buflen == bufsize - 1)
+        {
+          bufsize *= 2;
+          buf = xrealloc(buf, bufsize);
+        }
+        buf[buflen++] = in->paste.b[j];
+      }
+      buf[buflen] = '\0';
+    }
+
+    if (callback) callback(buf, c);
   } 
 }
 
 void editorMoveCursor(int key)  //move the cursor
 {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy]; //get the row that the cursor is on
+  erow *row = editorRow(E.cy); //get the row that the cursor is on, NULL past the end of the file
 
   switch (key) 
   {
     case ARROW_LEFT: if (E.cx != 0) 
-    { E.cx--; } 
+    { E.cx = editorRowPrevChar(row, E.cx); } //a whole grapheme cluster at a time
     else if (E.cy > 0) 
-    { E.cy--; E.cx = E.row[E.cy].size; }
+    { E.cy--; E.cx = editorRow(E.cy)->size; }
     break;
     case ARROW_RIGHT:
-      if (row && E.cx < row->size) { E.cx++; } 
+      if (row && E.cx < row->size) { E.cx = editorRowNextChar(row, E.cx); } 
       else if (row && E.cx == row->size) 
       { E.cy++; E.cx = 0; }
     break;
@@ -746,13 +5996,58 @@ void editorMoveCursor(int key)  //move the cursor
     case ARROW_DOWN: if (E.cy < E.numrows) { E.cy++; }
     break;
   }
+  editorCursorFit();
+}
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+void editorCursorFit() //keep the cursor within its row, and at the start of a character
+{
+  erow *row = editorRow(E.cy); //NULL past the end of the file
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) 
   {
     E.cx = rowlen;
   }
+  else if (E.cx < rowlen && (unsigned char)editorRowCharAt(row, E.cx) >= 0x80) //do not land inside a character
+  {
+    E.cx = editorRowPrevChar(row, E.cx + 1);
+  }
+}
+
+void editorGoTo() //jump to a line, a byte offset or a percentage of the way through the file
+{
+  /**A line is found through the row counts of the rope and a byte offset through the checkpoints, so either jump costs
+  *O(log n) whatever the size of the file, and only the rows that end up on the screen are built.
+  */
+  char *query = editorPrompt("Go to: %s (line, @byte or N%%, ESC to cancel)", NULL);
+  if (query == NULL) return;
+
+  int len = strlen(query), row = -1, col = 0;
+  char *end;
+  if (query[0] == '@') //a byte offset, counted from 0 like grep -b does
+  {
+    long long byte = strtoll(query + 1, &end, 0);
+    if (end != query + 1 && *end == '\0' && byte >= 0) row = editorOffsetRow(byte, &col);
+  }
+  else if (len > 1 && query[len - 1] == '%')
+  {
+    query[len - 1] = '\0';
+    double pct = strtod(query, &end);
+    if (end != query && *end == '\0' && pct >= 0) row = pct >= 100 ? E.numrows : (int)(pct / 100 * E.numrows);
+  }
+  else
+  {
+    long line = strtol(query, &end, 10);
+    if (end != query && *end == '\0') row = line < 1 ? 0 : line > E.numrows ? E.numrows : (int)line - 1;
+  }
+
+  if (row == -1) editorSetStatusMessage("Not a line, @byte or percentage: %s", query);
+  else
+  {
+    if (row >= E.numrows) row = E.numrows > 0 ? E.numrows - 1 : 0;
+    editorFindReveal(row, col); //centered on the screen, as search matches are
+    editorCursorFit();
+  }
+  free(query);
 }
 
 void editorProcessKeypress() //process keypresses from the user and take appropriate action
@@ -773,8 +6068,9 @@ void editorProcessKeypress() //process keypresses from the user and take appropr
       quit_times--;
       return;
     }
-      write(STDOUT_FILENO, "\x1b[2J", 4);
-      write(STDOUT_FILENO, "\x1b[H", 3);
+      write(E.outfd, "\x1b[2J", 4);
+      write(E.outfd, "\x1b[H", 3);
+      E.journal.discard = 1; //quitting gives up the unsaved edits, their journal goes too
       exit(0);
     break;
 
@@ -788,13 +6084,17 @@ void editorProcessKeypress() //process keypresses from the user and take appropr
 
     case END_KEY:
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRow(E.cy)->size;
     break;
 
     case CTRL_KEY('f'):
       editorFind();
     break;
 
+    case CTRL_KEY('g'): //Ctrl-G goes to a line, a byte offset or a percentage of the file
+      editorGoTo();
+    break;
+
     case BACKSPACE:
     case CTRL_KEY('h'): //Ctrl-H is equivalent to Backspace
     case DEL_KEY:
@@ -813,11 +6113,11 @@ void editorProcessKeypress() //process keypresses from the user and take appropr
           E.cy = E.rowoff + E.screenrows - 1;
           if (E.cy > E.numrows) E.cy = E.numrows; //if the cursor is past the end of the file, move it to the last row
         }
-        //simulate the user pressing the ↑ or ↓ keys enough times to move to the top or bottom of the screen. 
-        //Implementing Page Up and Page Down in this way will make it a lot easier for us later, when we implement scrolling.
-        int times = E.screenrows;
-        while (times--)
-          editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+        //then a screenful further, as pressing ↑ or ↓ that many times would, in one step
+        E.cy += c == PAGE_UP ? -E.screenrows : E.screenrows;
+        if (E.cy < 0) E.cy = 0;
+        if (E.cy > E.numrows) E.cy = E.numrows;
+        editorCursorFit();
       }
     break;
 
@@ -828,7 +6128,30 @@ void editorProcessKeypress() //process keypresses from the user and take appropr
       editorMoveCursor(c);
     break;
 
-    case CTRL_KEY('l'): //CTRL-L will refresh the screen
+    case CTRL_KEY('z'): //Ctrl-Z takes back the last edit
+      editorUndo();
+    break;
+
+    case CTRL_KEY('y'): //Ctrl-Y makes it again
+      editorRedo();
+    break;
+
+    case PASTE: //pasted text goes in as one edit, with one redraw
+      editorPaste();
+    break;
+
+    case FOLLOW: //the followed file changed, followPump() reads it before the next frame
+    return;
+
+    case CTRL_KEY('l'): //CTRL-L will repaint the whole screen
+      editorScreenInvalidate();
+    break;
+
+    case CTRL_KEY('p'): //Ctrl-P shows or hides the stats in the status bar
+      E.stats.overlay = (E.stats.overlay + 1) % 3; //the stats, then the memory report, then the file name again
+      E.changes++;
+    break;
+
     case '\x1b':
     break;
     
@@ -838,6 +6161,268 @@ void editorProcessKeypress() //process keypresses from the user and take appropr
   quit_times = KILO_QUIT_TIMES;
 }
 
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Headless ***************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**Headless mode runs the editor without a terminal so that it can be benchmarked. Keys come from a trace file, which
+*holds the bytes a terminal would have sent, and frames go to a capture file or /dev/null, on a screen of a fixed size.
+*Every key is handled and drawn on its own, as if keys came in slower than frames, and the time each one takes is
+*recorded. A report goes to standard output when the trace runs out or the editor quits.
+*/
+
+long long benchNanos() //nanoseconds on the monotonic clock
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void benchKeyStart() //a key is handed out
+{
+  E.bench.keystart = benchNanos();
+}
+
+void benchKeyDone() //the key handed out last has been handled, and its frame drawn
+{
+  struct benchStats *b = &E.bench;
+  if (!b->keystart) return;
+  if (b->n == b->cap)
+  {
+    b->cap = b->cap ? b->cap * 2 : 4096;
+    b->lat = xrealloc(b->lat, sizeof(long long) * b->cap);
+  }
+  b->lat[b->n++] = benchNanos() - b->keystart;
+  b->keystart = 0;
+}
+
+int benchCmp(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+void benchReport() //print what the keys of the trace cost
+{
+  struct benchStats *b = &E.bench;
+  benchKeyDone();
+  printf("%-8s open %8.1f ms", b->name, b->openms);
+  if (b->n)
+  {
+    qsort(b->lat, b->n, sizeof(long long), benchCmp);
+    long long total = 0;
+    int j;
+    for (j = 0; j < b->n; j++)
+      total += b->lat[j];
+    printf("  %7d keys %8.3f s %10.0f keys/s  p50 %8.1f us  p99 %8.1f us  max %8.1f us", b->n, total / 1e9,
+      b->n / (total / 1e9), b->lat[b->n / 2] / 1e3, b->lat[(int)(b->n * 0.99)] / 1e3, b->lat[b->n - 1] / 1e3);
+  }
+  printf("\n");
+}
+
+void editorHeadless(const char *trace, const char *size, const char *screen) //read keys from trace and draw into screen, or nowhere
+{
+  E.infd = open(trace, O_RDONLY);
+  if (E.infd == -1) die(trace);
+  E.outfd = open(screen ? screen : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (E.outfd == -1) die(screen);
+  E.screencols = 80;
+  E.screenrows = 24;
+  if (size && (sscanf(size, "%dx%d", &E.screencols, &E.screenrows) != 2 || E.screencols < 1 || E.screenrows < 3))
+  {
+    fprintf(stderr, "kilo: bad screen size '%s', expected COLSxROWS\n", size);
+    exit(1);
+  }
+  E.headless = 1;
+  E.bench.name = strrchr(trace, '/') ? strrchr(trace, '/') + 1 : trace;
+  E.bench.keystart = 0;
+  E.bench.lat = NULL;
+  E.bench.n = E.bench.cap = 0;
+  atexit(benchReport);
+}
+
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/******************************************************** Stats ******************************************************************/
+/*-------------------------------------------------------------------------------------------------------------------------------*/
+/**The editor times the phases of every key and frame, and counts the bytes each frame writes and the allocations made
+*for it. The main thread allocates through xmalloc(), xcalloc() and xrealloc(), which count the calls; the regex engine and
+*the search threads, which also run on worker threads, call the C library directly and are not counted.
+*Each kind of value goes into an HDR histogram: values are bucketed by their power of two, and each power of two is
+*split into 2^KILO_STAT_SUB_BITS buckets, so any percentile is known to within 1/16 of its value while a histogram stays a
+*fixed 4 KB. Recording is a clock read and an increment, cheap enough to be always on. Ctrl-P shows p50/p99 of every
+*histogram in the status bar, and KILO_STATS=FILE writes them all to FILE when the editor exits.
+*Pressing Ctrl-P again shows the memory report instead: the bytes of text in the file against the bytes it takes to hold
+*them, from the file mapping, the arena blocks and the slabs to the rows and the line index. The row memory keeps count of
+*what it hands out; the text and the rows are counted by walking the rope, which only looks into the leaves that were built.
+*/
+
+const char *statNames[STAT_HISTS] = {"decode", "edit", "scroll", "draw", "write", "bytes", "allocs"};
+
+int statBucket(unsigned long long v) //the bucket v falls in
+{
+  if (v < (1u << KILO_STAT_SUB_BITS)) return v;
+  int shift = 63 - __builtin_clzll(v) - KILO_STAT_SUB_BITS;
+  return ((shift + 1) << KILO_STAT_SUB_BITS) + ((v >> shift) & ((1u << KILO_STAT_SUB_BITS) - 1));
+}
+
+long long statBucketLow(int b) //the smallest value in bucket b
+{
+  if (b < (1 << KILO_STAT_SUB_BITS)) return b;
+  int shift = (b >> KILO_STAT_SUB_BITS) - 1;
+  return (long long)((1 << KILO_STAT_SUB_BITS) + (b & ((1 << KILO_STAT_SUB_BITS) - 1))) << shift;
+}
+
+long long statBucketHigh(int b) //the largest value in bucket b
+{
+  if (b < (1 << KILO_STAT_SUB_BITS)) return b;
+  return statBucketLow(b) + (1LL << ((b >> KILO_STAT_SUB_BITS) - 1)) - 1;
+}
+
+void statRecord(int hist, long long value)
+{
+  struct statHistogram *h = &E.stats.hist[hist];
+  if (value < 0) value = 0;
+  h->counts[statBucket(value)]++;
+  h->count++;
+  h->sum += value;
+  if (value > h->max) h->max = value;
+}
+
+long long statPercentile(struct statHistogram *h, double q) //the value that a fraction q of the recorded values are at most
+{
+  if (!h->count) return 0;
+  long long want = (long long)(q * h->count + 0.5), seen = 0;
+  if (want < 1) want = 1;
+  int b;
+  for (b = 0; b < KILO_STAT_BUCKETS; b++)
+  {
+    seen += h->counts[b];
+    if (seen >= want) break;
+  }
+  long long high = statBucketHigh(b);
+  return high < h->max ? high : h->max;
+}
+
+void statEditStart() //a key is handed out to be handled
+{
+  E.stats.editstart = benchNanos();
+}
+
+void statEditDone() //the key handed out last has been handled: it asked for the next key, or a frame is being drawn
+{
+  if (!E.stats.editstart) return;
+  statRecord(STAT_EDIT, benchNanos() - E.stats.editstart);
+  E.stats.editstart = 0;
+}
+
+void *xmalloc(size_t size) //malloc() for the main thread, counted for the stats
+{
+  E.stats.allocs++;
+  return malloc(size);
+}
+
+void *xcalloc(size_t n, size_t size) //calloc() for the main thread, counted for the stats
+{
+  E.stats.allocs++;
+  return calloc(n, size);
+}
+
+void *xrealloc(void *p, size_t size) //realloc() for the main thread, counted for the stats
+{
+  E.stats.allocs++;
+  return realloc(p, size);
+}
+
+void memWalk(rnode *t, struct memUsage *u) //count the text and the rows of a subtree of the rope
+{
+  if (!t) return;
+  memWalk(t->left, u);
+  memWalk(t->right, u);
+  u->leaves++;
+  u->rows += sizeof(rnode);
+  if (!t->rows) //the text is still in the mapping: its lines less their line endings
+  {
+    if (t->line0 < 0 || t->n == 0) return;
+    u->text += ropeMappedText(t, 0, t->n);
+    return;
+  }
+  u->built++;
+  u->rows += sizeof(erow) * KILO_ROPE_LEAF_MAX;
+  int j;
+  for (j = 0; j < t->n; j++)
+  {
+    erow *row = &t->rows[j];
+    u->text += row->size;
+    if (row->longhl) u->longhl += sizeof(rowLong) + sizeof(rowChunk) * row->longhl->cap;
+  }
+}
+
+void memMeasure(struct memUsage *u) //count what the text of the file takes
+{
+  memset(u, 0, sizeof(*u));
+  memWalk(E.rope, u);
+  u->index = E.maplines * (sizeof(size_t) + sizeof(unsigned));
+}
+
+size_t memTotal(struct memUsage *u) //bytes it all takes
+{
+  struct rowMemory *m = &E.mem;
+  return E.maplen + m->arena + m->slabpages + m->heap + u->rows + u->index + u->longhl + E.undo.cap;
+}
+
+int memOverlay(char *buf, int size) //the memory report, in MB, for the status bar
+{
+  struct memUsage u;
+  struct rowMemory *m = &E.mem;
+  memMeasure(&u);
+  size_t total = memTotal(&u);
+  int len = snprintf(buf, size, "MB text %.1f | map %.1f arena %.1f slab %.1f heap %.1f | rows %.1f index %.1f undo %.1f | +%.0f%%",
+    u.text / 1e6, E.maplen / 1e6, m->arena / 1e6, m->slabpages / 1e6, m->heap / 1e6, (u.rows + u.longhl) / 1e6, u.index / 1e6,
+    E.undo.cap / 1e6, u.text ? (total - (double)u.text) * 100 / u.text : 0.0);
+  return len < size ? len : size - 1;
+}
+
+int statOverlay(char *buf, int size) //the p50/p99 of every histogram, in microseconds for the timings, for the status bar
+{
+  if (E.stats.overlay == 2) return memOverlay(buf, size);
+  int len = 0, j;
+  for (j = 0; j < STAT_HISTS && len < size; j++)
+  {
+    struct statHistogram *h = &E.stats.hist[j];
+    if (j < STAT_BYTES)
+      len += snprintf(buf + len, size - len, "%s %.0f/%.0f ", statNames[j], statPercentile(h, 0.5) / 1e3, statPercentile(h, 0.99) / 1e3);
+    else
+      len += snprintf(buf + len, size - len, "%s%s %lld/%lld ", j == STAT_BYTES ? "us | " : "", statNames[j], statPercentile(h, 0.5), statPercentile(h, 0.99));
+  }
+  return len < size ? len : size - 1;
+}
+
+void statDump() //write every histogram to the KILO_STATS file
+{
+  FILE *fp = fopen(E.stats.dump, "w");
+  if (!fp) return;
+  fprintf(fp, "# %lld frames, %lld bytes written, %lu allocations\n", E.stats.frames, E.stats.written, E.stats.allocs);
+  struct memUsage u;
+  struct rowMemory *m = &E.mem;
+  memMeasure(&u);
+  fprintf(fp, "# memory in bytes: %zu of text held in %zu: mapping %zu, arena %zu, slab pages %zu (%zu handed out), heap %zu, "
+    "rows %zu (%ld of %ld leaves built), long rows %zu, line index %zu, undo %d\n", u.text, memTotal(&u), E.maplen, m->arena,
+    m->slabpages, m->slabused, m->heap, u.rows, u.built, u.leaves, u.longhl, u.index, E.undo.cap);
+  fprintf(fp, "# times are in nanoseconds; buckets are listed as: histogram low high count\n");
+  fprintf(fp, "%-8s %10s %12s %12s %12s %12s %12s %12s\n", "#", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+  int j, b;
+  for (j = 0; j < STAT_HISTS; j++)
+  {
+    struct statHistogram *h = &E.stats.hist[j];
+    fprintf(fp, "%-8s %10lld %12.0f %12lld %12lld %12lld %12lld %12lld\n", statNames[j], h->count, h->count ? (double)h->sum / h->count : 0.0,
+      statPercentile(h, 0.5), statPercentile(h, 0.9), statPercentile(h, 0.99), statPercentile(h, 0.999), h->max);
+  }
+  for (j = 0; j < STAT_HISTS; j++)
+    for (b = 0; b < KILO_STAT_BUCKETS; b++)
+      if (E.stats.hist[j].counts[b])
+        fprintf(fp, "%s %lld %lld %u\n", statNames[j], statBucketLow(b), statBucketHigh(b), E.stats.hist[j].counts[b]);
+  fclose(fp);
+}
+
 /*-------------------------------------------------------------------------------------------------------------------------------*/
 /******************************************************** Initialization *********************************************************/
 /*-------------------------------------------------------------------------------------------------------------------------------*/
@@ -849,36 +6434,160 @@ void initEditor() //initialize all fields in the E struct
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.rope = NULL;
   E.dirty = 0;
   E.filename = NULL;
+  E.map = NULL;
+  E.maplen = 0;
+  E.lineend = NULL;
+  E.maplines = 0;
+  E.linetabs = NULL;
+  memset(&E.mem, 0, sizeof(E.mem));
+  E.checkpoints.off = NULL;
+  E.checkpoints.n = E.checkpoints.cap = 0;
+  E.crlf = 0;
+  E.eolmixed = 0;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+  E.screen = NULL;
+  E.screenlines = 0;
+  E.frame.b = E.linebuf.b = NULL;
+  E.frame.len = E.linebuf.len = 0;
+  E.frame.cap = E.linebuf.cap = 0;
+  E.hlbuf.b = NULL;
+  E.hlbuf.len = E.hlbuf.cap = 0;
+  E.hlcols.b = NULL;
+  E.hlcols.len = E.hlcols.cap = 0;
+  E.hlsrc.b = NULL;
+  E.hlsrc.len = E.hlsrc.cap = 0;
+  E.lexbuf.b = NULL;
+  E.lexbuf.len = E.lexbuf.cap = 0;
+  E.syntax = NULL;
+  E.hlvalid = 0;
+  E.search.query = NULL;
+  E.search.len = 0;
+  E.search.regex = 0;
+  E.search.re = NULL;
+  E.search.rc = NULL;
+  E.search.error = NULL;
+  E.search.row = -1;
+  E.search.tasks = NULL;
+  E.search.spans = NULL;
+  E.search.ntasks = E.search.nspans = E.search.spanscap = E.search.nthreads = 0;
+  E.undo.buf = NULL;
+  E.undo.len = E.undo.cap = E.undo.pos = 0;
+  E.undo.nextid = E.undo.baseid = E.undo.savedid = E.undo.replaying = 0;
+  E.undo.limit = KILO_UNDO_LIMIT;
+  E.journal.on = E.journal.discard = 0;
+  E.journal.fd = -1;
+  E.journal.path = NULL;
+  E.follow.on = E.follow.pending = E.follow.partial = 0;
+  E.follow.fd = E.follow.notifyfd = E.follow.wd = E.follow.dirwd = -1;
+  E.follow.buf.b = NULL;
+  E.follow.buf.len = E.follow.buf.cap = 0;
+  char *undomb = getenv("KILO_UNDO_MB");
+  if (undomb && atoi(undomb) > 0 && atoi(undomb) <= 1024) E.undo.limit = atoi(undomb) * 1024 * 1024;
+  E.lastcx = E.lastcy = 0;
+  E.changes = 0;
+  memset(&E.shown, 0, sizeof(E.shown));
+  E.frameinterval = 1000 / KILO_FPS;
+  char *fps = getenv("KILO_FPS");
+  if (fps && atoi(fps) > 0 && atoi(fps) <= 1000) E.frameinterval = 1000 / atoi(fps);
+  E.resized = 0;
+  E.stats.overlay = 0;
+  E.stats.dump = getenv("KILO_STATS");
+  if (E.stats.dump && *E.stats.dump) atexit(statDump);
+
+  if (!E.headless && getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize"); //headless, the size is already set
   E.screenrows -= 2; //leave room for the status bar
+  editorScreenInvalidate();
+
+  E.input.len = E.input.head = E.input.nkeys = E.input.pasting = 0;
+  E.input.paste.b = NULL;
+  E.input.paste.len = E.input.paste.cap = 0;
+  E.input.npastes = E.input.pastehead = E.input.pastefrom = E.input.pasteto = 0;
+  if (pipe(E.input.wakefd) == -1) die("pipe");
+  fcntl(E.input.wakefd[0], F_SETFL, O_NONBLOCK);
+  fcntl(E.input.wakefd[1], F_SETFL, O_NONBLOCK);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleResize;
+  sigaction(SIGWINCH, &sa, NULL);
+  sa.sa_handler = editorHandleHangup;
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  E.hangup = 0;
 }
 /*-------------------------------------------------------------------------------------------------------------------------------*/
 /***************************************************** Main **********************************************************************/
 /*-------------------------------------------------------------------------------------------------------------------------------*/
 int main(int argc, char *argv[]) //main function
 {
-  enableRawMode(); //enable raw mode
+  if (argc >= 2 && strcmp(argv[1], "--selftest") == 0) return scanSelfTest() | eolSelfTest();
+  char *trace = NULL, *size = NULL, *screen = NULL;
+  int arg = 1, follow = 0;
+  E.infd = STDIN_FILENO;
+  E.outfd = STDOUT_FILENO;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) //options come before the file name
+  {
+    if (strcmp(argv[arg], "--follow") == 0) follow = 1;
+    else if (arg + 1 == argc) break;
+    else if (strcmp(argv[arg], "--headless") == 0) trace = argv[++arg];
+    else if (strcmp(argv[arg], "--size") == 0) size = argv[++arg];
+    else if (strcmp(argv[arg], "--screen") == 0) screen = argv[++arg];
+    else break;
+  }
+  if (arg < argc - 1 || (arg < argc && strncmp(argv[arg], "--", 2) == 0) || ((size || screen) && !trace) || (follow && arg == argc))
+  {
+    fprintf(stderr, "usage: kilo [--headless TRACE [--size COLSxROWS] [--screen FILE]] [[--follow] FILE]\n       kilo --selftest\n");
+    return 1;
+  }
+
+  if (trace) editorHeadless(trace, size, screen);
+  else enableRawMode(); //enable raw mode
   initEditor(); //initialize the editor
+  E.follow.on = follow;
   
-  if (argc >= 2) 
+  if (arg < argc) 
   {
-    editorOpen(argv[1]);
+    long long start = benchNanos();
+    editorOpen(argv[arg]);
+    E.bench.openms = (benchNanos() - start) / 1e6;
   }
 
-  editorSetStatusMessage("HELP: Ctrl-S = Save || Ctrl-Q = Quit || Ctrl-F = Find"); //display a help message in the status bar
+  editorSetStatusMessage("HELP: Ctrl-S = Save || Ctrl-Q = Quit || Ctrl-F = Find || Ctrl-Z = Undo"); //display a help message in the status bar
+  journalOpen(1); //after the help, so that news of recovered edits is what shows
 
-  while (1) 
+  while (E.headless) //every key gets a frame of its own, so that it can be timed
   {
+    journalPump();
+    followPump();
     editorRefreshScreen();
     editorProcessKeypress();
   }
 
+  while (1) 
+  {
+    /**Frames are at least E.frameinterval apart. Keys that come in before the next frame is due are all handled first
+    *and share it, so a burst of keys draws a few frames instead of one per key. Once the frame is due, only the input
+    *that was already read is handled before drawing, which bounds the delay between a key and its frame.
+    */
+    journalPump(); //the journal writer is woken once a frame, not once a key
+    followPump(); //and a followed file is read once a frame
+    editorRefreshScreen();
+    long due = editorMillis() + E.frameinterval;
+    editorProcessKeypress(); //sleeps until there is a key
+    while (1)
+    {
+      long left = due - editorMillis();
+      if (!editorWaitKey(left > 0 ? left : 0)) break; //no more keys before the frame is due
+      editorProcessKeypress();
+      if (left <= 0 && !editorKeyPending()) break;
+    }
+  }
+
   return 0;
 }
 
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Runs kilo --selftest, then replays keystroke traces with kilo --headless and compares the saved files.
+# Usage: ./test.sh
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+fail=0
+
+./kilo --selftest || fail=1
+
+check() { # check NAME FILE TRACE EXPECTED: open FILE, replay TRACE, and the saved file must be EXPECTED (printf formats)
+  printf "$2" > "$DIR/file"
+  printf "$3" > "$DIR/trace"
+  ./kilo --headless "$DIR/trace" "$DIR/file" > /dev/null || { echo "$1: kilo failed"; fail=1; return; }
+  if [ "$(od -c "$DIR/file")" == "$(printf "$4" | od -c)" ]; then
+    echo "$1: ok"
+  else
+    echo "$1: saved file differs"; od -c "$DIR/file"; fail=1
+  fi
+}
+
+check "mostly LF endings stay LF" 'a\nb\r\nc\n' 'x\023' 'xa\nb\nc\n'
+check "CRLF endings stay CRLF" 'a\r\nb\r\nc\n' 'x\023' 'xa\r\nb\r\nc\r\n'
+lf=$(printf 'a\\n%.0s' {1..150}) # more lines than a rope leaf holds
+check "mixed endings over several leaves" "${lf}b\\r\\n${lf}" 'x\023' "x${lf}b\\n${lf}"
+pgdn=$(printf '\\033[6~%.0s' {1..20})
+check "mixed endings saved the same after scrolling" "${lf}b\\r\\n${lf}" "x${pgdn}\\023" "x${lf}b\\n${lf}"
+check "two pastes in one read" 'x\n' '\033[200~AAA\033[201~\033[200~BBB\033[201~\023' 'AAABBBx\n'
+check "paste of several lines" 'x\n' '\033[200~a\rb\r\nc\033[201~-\033[200~d\033[201~\023' 'a\nb\nc-dx\n'
+check "search from past the last line" 'a\nb\nc\n' '\033[B\033[B\033[B\006zzz\033[A\033[B\rx\023' 'a\nb\nc\nx\n'
+
+exit $fail